@@ -0,0 +1,50 @@
+#include <comp-defs.h>
+#include <eeprom.h>
+
+/*
+	Waits until the last write is complete. SPM doesn't work meanwhile,
+	page buffer loads would be lost.
+ */
+void __text eeprom_wait(void)
+{
+	while (io_read(eecr) & (1U << eewe)) ;
+}
+
+static void __text eeprom_select(uint16_t addr)
+{
+	/* Previous write must complete before EEAR changes */
+	eeprom_wait();
+
+	io_write(eearh, (uint8_t) (addr >> 8));
+	io_write(eearl, (uint8_t) addr);
+}
+
+uint8_t __text eeprom_read(uint16_t addr)
+{
+	eeprom_select(addr);
+	io_write(eecr, (1U << eere));
+
+	return io_read(eedr);
+}
+
+/*
+	Writes @value at @addr. The cell is left alone if it holds the value
+	already, since every write wears it out. The routine returns right
+	after the write is started, it takes 8.5 ms to complete.
+	EEPROM is not written while SPM is busy, so the flash must be idle,
+	and no SPM may follow before eeprom_wait().
+ */
+void __text eeprom_write(uint16_t addr, uint8_t value)
+{
+	uint8_t flags;
+
+	if (eeprom_read(addr) == value)
+		return;
+	io_write(eedr, value);
+
+	flags = irq_save();
+	/* EEWE must be set within four cycles after EEMWE */
+	io_write(eecr, (1U << eemwe));
+	io_write(eecr, (1U << eemwe) | (1U << eewe));
+	irq_restore(flags);
+}
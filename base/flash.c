@@ -11,12 +11,46 @@ enum spm_state {
 	spm_writing = 2,
 	/* Setting lock bits initiated */
 	spm_locking = 3,
+	/* Erasing of the page to be written next initiated */
+	spm_erasing_ahead = 4,
+	/* Erasing of the page consisting of 0xFF only initiated */
+	spm_clearing = 5,
 };
 
+/*
+	Flash engine keeps upto two pages. The one being erased and written
+	lives in hardware page buffer. The next one is assembled in spm_buffer
+	meanwhile and is moved to hardware buffer by SPM ISR as soon as the
+	previous page is done. SPM ISR runs with IRQs enabled, so the move
+	doesn't hold USART off. It only races with the main context, which
+	it preempts, and the flash is idle whenever the main context moves
+	a page itself.
+	Pages which flash holds already are skipped, and blank pages are only
+	erased. Once a page is actually written, the next one is erased right
+	away if it lies below the limit, so committing it takes page writing only.
+	Unchanged pages do not trigger that, since their flash content is needed
+	for comparison. Pages are compared in the main context, word by word as
+	they go to hardware buffer or by write_page() if the flash is idle by
+	then. Flash can't be read while it is busy, so pages SPM ISR moves are
+	written as they are.
+ */
 struct spm_data {
 	enum spm_state state;
 	uint16_t address;
 	callback_t cb;
+	/* Page being loaded goes to spm_buffer */
+	uint8_t to_buffer;
+	/* spm_buffer holds complete page waiting for the flash */
+	uint8_t queued;
+	callback_t queued_cb;
+	/* Page at `address` is erased already */
+	uint8_t erased;
+	/* Pages below this address may be erased ahead */
+	uint16_t limit;
+	/* Latest loaded page consists of 0xFF only */
+	uint8_t blank;
+	/* Latest loaded page equals flash content */
+	uint8_t same;
 };
 
 static volatile struct spm_data ___data = {
@@ -24,6 +58,118 @@ static volatile struct spm_data ___data = {
 	.address = 0x0000U,
 };
 
+static uint16_t __text lpm_word(uint16_t addr)
+{
+	return ((uint16_t) lpm(addr)) | (((uint16_t) lpm(addr + 1U)) << 8);
+}
+
+/*
+	Starts committing the loaded page.
+	Returns zero if flash holds the page already. IRQs are disabled.
+ */
+static uint8_t __text spm_start_page(callback_t cb)
+{
+	if (___data.address >= ((uint16_t) (&__text_start)))
+		die();
+
+	___data.cb = cb;
+	if (___data.same ||
+	    (___data.erased && ___data.blank))
+		return 0x00U;
+
+	if (___data.erased) {
+		_write_page(___data.address);
+		___data.state = spm_writing;
+	} else {
+		_erase_page(___data.address);
+		___data.state = ___data.blank ? spm_clearing : spm_erasing;
+	}
+	return 0x01U;
+}
+
+/* Erases the page to be written next before its data is complete. IRQs are disabled */
+static void __text spm_erase_ahead(void)
+{
+	if (___data.erased ||
+	    ___data.address >= ___data.limit ||
+	    ___data.address >= ((uint16_t) (&__text_start)))
+		return;
+
+	_erase_page(___data.address);
+	___data.state = spm_erasing_ahead;
+}
+
+static void __text spm_start_queued(void);
+
+/*
+	Page at `address` is committed. Goes on with the next one.
+	IRQs are disabled, or SPM ISR runs.
+ */
+static void __text spm_finish_page(uint8_t written)
+{
+	callback_t cb;
+
+	/* Clears hardware buffer and makes RWW section readable */
+	_enable_rww_sect();
+	___data.address += ((uint16_t) (&__flash_page));
+	___data.erased   = 0x00U;
+	cb = ___data.cb;
+	___data.state = spm_noop;
+	___data.cb    = (callback_t) ((uint16_t) 0);
+	/* Hardware buffer is free. Next page may go in */
+	if (___data.queued)
+		spm_start_queued();
+	else if (written)
+		spm_erase_ahead();
+	cb();
+}
+
+/*
+	Moves the queued page to hardware buffer and starts it.
+	The flash is idle, so SPM ISR stays away until the page is started.
+ */
+static void __text spm_start_queued(void)
+{
+	uint16_t *p;
+	uint16_t addr;
+	uint8_t flags;
+
+	___data.queued = 0x00U;
+
+	if (!___data.same && !___data.blank) {
+		addr = ___data.address;
+		for (p = spm_buffer;
+		     p < spm_buffer_end;
+		     p++, addr += 2U) {
+			_store_temp_buffer(addr, *p);
+		}
+	}
+
+	flags = irq_save();
+	if (!spm_start_page(___data.queued_cb))
+		spm_finish_page(0x00U);
+	irq_restore(flags);
+}
+
+/* Tells whether flash holds spm_buffer at `address`. The flash must be idle */
+static uint8_t __text spm_buffer_same(void)
+{
+	uint16_t *p;
+	uint16_t addr;
+
+	/* Page erased ahead may only be written */
+	if (___data.erased)
+		return 0x00U;
+	addr = ___data.address;
+	for (p = spm_buffer; p < spm_buffer_end; p++, addr += 2U) {
+		if (lpm_word(addr) != *p)
+			return 0x00U;
+	}
+
+	return 0x01U;
+}
+
+/* IRQs are enabled, but SPM IRQ is masked */
 void __text spm_handler(void)
 {
 	callback_t cb;
@@ -33,14 +179,24 @@ void __text spm_handler(void)
 		_write_page(___data.address);
 		___data.state = spm_writing;
 		break;
-	case spm_writing:
+	case spm_erasing_ahead:
+		/* Hardware buffer is empty here. Keep RWW section readable */
 		_enable_rww_sect();
-		___data.address += ((uint16_t) (&__flash_page));
-		/* FALLTHROUGH */
+		___data.state  = spm_noop;
+		___data.erased = 0x01U;
+		if (___data.queued)
+			spm_start_queued();
+		break;
+	case spm_writing:
+	case spm_clearing:
+		spm_finish_page(0x01U);
+		break;
 	case spm_locking:
 		cb = ___data.cb;
 		___data.state = spm_noop;
 		___data.cb    = (callback_t) ((uint16_t) 0);
+		if (___data.queued)
+			spm_start_queued();
 		cb();
 		break;
 	default:
@@ -49,37 +205,144 @@ void __text spm_handler(void)
 }
 
 /*
-	The routine initiates non-blocking flash write operation consisting of
-	filling hardware buffer, page erasing and page writing.
-	The function is written in a way so spm_buffer may be instantly reused upon
-	function return.
+	Stores @data at @offset within the page to be written next.
+	The page goes straight to hardware buffer if the flash is idle when
+	its first word is loaded. Otherwise it is assembled in spm_buffer.
+	Upto one page may wait for the flash, so the caller must not start
+	a new page unless can_load_page() says so.
  */
-void __text write_page(callback_t cb)
+void __text load_page_word(uint16_t offset, uint16_t data)
 {
-	uint16_t *p;
-	uint16_t addr;
 	uint8_t flags;
 
 	flags = irq_save();
 
-	addr = ___data.address;
-	if ((___data.state != spm_noop) ||
-	    (addr >= ((uint16_t) (&__text_start))))
-		die();
+	if (!offset) {
+		if (___data.queued)
+			die();
+		___data.to_buffer = (___data.state != spm_noop);
+		___data.blank     = 0x01U;
+		/* Flash is busy for spm_buffer, see write_page() */
+		___data.same      = !___data.to_buffer && !___data.erased;
+	}
+
+	if (data != 0xffffU)
+		___data.blank = 0x00U;
 
-	for (p = spm_buffer;
-	     p < spm_buffer_end;
-	     p++, addr += 2U) {
-		_store_temp_buffer(addr, *p);
+	if (___data.to_buffer) {
+		spm_buffer[offset >> 1] = data;
+	} else {
+		if (___data.same &&
+		    lpm_word(___data.address + offset) != data)
+			___data.same = 0x00U;
+		_store_temp_buffer(___data.address + offset, data);
 	}
-	_erase_page(___data.address);
 
-	___data.state = spm_erasing;
-	___data.cb = cb;
+	irq_restore(flags);
+}
+
+/* Tells whether any flash operation is in progress or pending */
+uint8_t __text flash_busy(void)
+{
+	return (___data.state != spm_noop) || ___data.queued;
+}
+
+/* Tells whether a new page may be loaded by load_page_word() */
+uint8_t __text can_load_page(void)
+{
+	return !___data.queued;
+}
+
+/*
+	The routine initiates non-blocking write of the page loaded by
+	load_page_word(). It consists of page erasing and page writing.
+	If the flash is still busy with the previous page, the page is queued
+	and SPM ISR starts it later. @cb is called once the page is written,
+	or right away if flash holds the page already.
+ */
+void __text write_page(callback_t cb)
+{
+	uint8_t flags, idle;
+
+	flags = irq_save();
+
+	if (!___data.to_buffer) {
+		if (___data.state != spm_noop)
+			die();
+		if (!spm_start_page(cb))
+			spm_finish_page(0x00U);
+		irq_restore(flags);
+		return;
+	}
+
+	___data.queued    = 0x01U;
+	___data.queued_cb = cb;
+	___data.to_buffer = 0x00U;
+	idle = (___data.state == spm_noop);
+
+	irq_restore(flags);
+
+	/*
+		Otherwise SPM ISR starts it. The flash is readable here, so the
+		page is compared first. It takes long, so IRQs stay enabled.
+	 */
+	if (idle) {
+		___data.same = spm_buffer_same();
+		spm_start_queued();
+	}
+}
+
+/*
+	Allows pages below @limit to be erased before their data is complete.
+	Erasing ahead starts once a page is actually written. Pages the caller
+	may not be going to load must stay above the limit.
+ */
+void __text set_erase_limit(uint16_t limit)
+{
+	uint8_t flags;
+
+	flags = irq_save();
+	___data.limit = limit;
+	irq_restore(flags);
+}
+
+/*
+	Makes the page at @address the one to be loaded next.
+	Pages between the current one and it are left intact.
+	The flash must be idle and no page may be partially loaded.
+ */
+void __text seek_page(uint16_t address)
+{
+	uint8_t flags;
+
+	flags = irq_save();
+
+	if (flash_busy())
+		die();
+	___data.address = address;
+	___data.erased  = 0x00U;
 
 	irq_restore(flags);
 }
 
+/* CRC-32 of the flash page at @address. The flash must be idle */
+uint32_t __text page_hash(uint16_t address)
+{
+	uint32_t crc;
+	uint16_t end;
+	uint8_t bit;
+
+	crc = 0xffffffffUL;
+	end = address + ((uint16_t) (&__flash_page));
+	for (; address < end; address++) {
+		crc ^= lpm(address);
+		for (bit = 0U; bit < 8U; bit++)
+			crc = (crc >> 1) ^ ((crc & 0x01U) ? 0xedb88320UL : 0x00000000UL);
+	}
+
+	return ~crc;
+}
+
 void __text set_lock_bits(callback_t cb, uint8_t bits)
 {
 	uint8_t flags;
@@ -0,0 +1,58 @@
+#include <comp-defs.h>
+#include <lz.h>
+
+/*
+	Compressed stream is a sequence of tokens:
+	  0nnnnnnn                -- literal run. n + 1 bytes follow as is.
+	  1nnnnnnn dddddddd       -- match. n + LZ_MATCH_MIN bytes are copied
+	                             from d + 1 bytes behind the output. Match
+	                             may overlap its own output.
+	There is no separate window. Matches refer to the output itself,
+	so they never reach beyond the data expanded from the same packet.
+ */
+
+/*
+	Expands @nr compressed bytes at @buf in place. The output may extend
+	upto @buf_end. Compressed bytes are moved to the end of the buffer first
+	and the output grows from @buf towards them. The host has to make sure
+	the output never catches up with compressed bytes not read yet.
+	Returns the size of the output, or zero if the stream is malformed.
+ */
+uint16_t __text lz_inflate(uint8_t *buf, uint16_t nr, uint8_t *buf_end)
+{
+	uint8_t *in, *out, *src;
+	uint8_t token, n;
+
+	in  = buf_end;
+	src = buf + nr;
+	while (src > buf)
+		*(--in) = *(--src);
+
+	out = buf;
+	while (in < buf_end) {
+		token = *(in++);
+		if (!(token & 0x80U)) {
+			n = token + 1U;
+			if (n > buf_end - in)
+				return 0U;
+			do {
+				*(out++) = *(in++);
+			} while (--n);
+			continue;
+		}
+		if (in == buf_end)
+			return 0U;
+		/* Nothing to copy from, or compressed bytes would be overwritten */
+		if (*in >= out - buf)
+			return 0U;
+		src = out - 1U - *(in++);
+		n   = (token & 0x7fU) + LZ_MATCH_MIN;
+		if (n > in - out)
+			return 0U;
+		do {
+			*(out++) = *(src++);
+		} while (--n);
+	}
+
+	return (uint16_t) (out - buf);
+}
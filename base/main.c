@@ -5,11 +5,13 @@
 #include <flash.h>
 #include <usart.h>
 #include <proto.h>
+#include <lz.h>
+#include <eeprom.h>
 
 #define DEBUG    1
 
 struct board_info info = {
-	/* Unfortunately, there is no way to obtain calibration data at run-time :( */
+	/* Defaults until the host calibrates the clock, see PACKET_CAL */
 	.cal_data = {
 		0xa9,0xa9,0xa7,0xa7
 	},
@@ -25,56 +27,38 @@ static void __head __noinline setup(void)
 	info.fuses.low  = f_low;
 	info.fuses.high = f_high;
 
+	/* The line rate is measured later, see usart_autobaud() */
 	switch (f_low & ((uint8_t) 0x0f)) {
 	case ((uint8_t) 0x01):
 		info.frequency  = 1;
-		info.usart.ubrr        = 12U;
-		info.usart.bps         = bps_9600;
-		info.usart.timer_thres = 4U;
-		cal_data               = info.cal_data[0];
+		info.cal_idx           = 0U;
 		break;
 	case ((uint8_t) 0x02):
 		info.frequency         = 2;
-		info.usart.ubrr        = 25U;
-		info.usart.bps         = bps_9600;
-		info.usart.timer_thres = 8U;
-		cal_data               = info.cal_data[1];
+		info.cal_idx           = 1U;
 		break;
 	case ((uint8_t) 0x03):
 		info.frequency         = 4;
-		info.usart.ubrr        = 12U;
-		info.usart.bps         = bps_38400;
-		info.usart.timer_thres = 16U;
-		cal_data               = info.cal_data[2];
+		info.cal_idx           = 2U;
 		break;
 	case ((uint8_t) 0x04):
 		info.frequency         = 8;
-		info.usart.ubrr        = 25U;
-		info.usart.bps         = bps_38400;
-		info.usart.timer_thres = 32U;
-		cal_data               = info.cal_data[3];
+		info.cal_idx           = 3U;
 		break;
 	default:
 		/* Unknown frequency. Panic. */
 		die();
 	}
 
+	cal_data = eeprom_read(EEPROM_CAL_DATA + info.cal_idx);
+	if (cal_data == 0xffU)
+		cal_data = info.cal_data[info.cal_idx];
 	io_write(osccal, cal_data);
 }
 
 static inline void __head move_ivt_2_bls(void)
 {
-	uint8_t enable, set;
-
-	enable = 1U << ivce;
-	set    = 1U << ivsel;
-	asm volatile ( "out %[io_loc],%[enable]\n\t"
-		       "out %[io_loc],%[set]\n\t"
-		       : /* no output operands */
-		       : [io_loc] "I" (gicr),
-			 [enable] "r" (enable),
-			 [set] "r" (set)
-		       : "memory" );
+	io_write_timed(gicr, 1U << ivce, 1U << ivsel);
 }
 
 static volatile uint8_t may_continue = 0x00U;
@@ -92,21 +76,24 @@ static void __head locking_cb(void)
 }
 
 #if 0
-/* Makes spm_buffer consisting of 0xFF only */
-static inline void __text flash_ut__make_ff(void)
+/* Loads @s into hardware page buffer padding it with 0xFF */
+static inline void __text flash_ut__load_str(const char *s)
 {
-	uint16_t *p;
-
-	for (p = spm_buffer;
-	     p < spm_buffer_end;
-	     p++)
-		*p = 0xffffU;
-}
-
-static inline void __text flash_ut__strcpy(char *dst, const char *src)
-{
-	for (; *src; src++, dst++)
-		*dst = *src;
+	uint16_t offset, word;
+
+	for (offset = 0U;
+	     offset < ((uint16_t) (&__flash_page));
+	     offset += 2U) {
+		word = 0xffffU;
+		if (*s) {
+			word = (uint8_t) *(s++);
+			if (*s)
+				word = (word & 0x00ffU) | (((uint16_t) (uint8_t) *(s++)) << 8);
+			else
+				word |= 0xff00U;
+		}
+		load_page_word(offset, word);
+	}
 }
 
 static void __text flash_ut_null_cb(void)
@@ -117,21 +104,20 @@ static void __text flash_ut_null_cb(void)
 
 static void __text flash_ut_second_cb(void)
 {
-	uint8_t *ptr, *end;
 	uint16_t addr;
 
-	ptr = (uint8_t *) spm_buffer;
-	end = (uint8_t *) spm_buffer_end;
-	addr = 0U;
-	for (; ptr < end; ptr++, addr++)
-		*ptr = lpm(addr);
+	for (addr = 0U; addr < ((uint16_t) (&__flash_page)); addr += 2U)
+		load_page_word(addr, (uint16_t) lpm(addr) | (((uint16_t) lpm(addr + 1U)) << 8));
 
 	write_page(flash_ut_null_cb);
 }
 
 static void __text flash_ut_first_cb(void)
 {
-	/* Here we check that we can actually write page in ISR context */
+	static const char data_ut_first_cb[] = "flash_ut_first_cb data";
+
+	/* Here we check that we can actually load and write page in ISR context */
+	flash_ut__load_str(data_ut_first_cb);
 	write_page(flash_ut_second_cb);
 }
 
@@ -139,14 +125,9 @@ static void __text flash_ut_first_cb(void)
 static void __text flash_ut(void)
 {
 	static const char data_ut[] = "flash_ut data";
-	static const char data_ut_first_cb[] = "flash_ut_first_cb data";
 
-	flash_ut__make_ff();
-	flash_ut__strcpy((char *) spm_buffer, data_ut);
+	flash_ut__load_str(data_ut);
 	write_page(flash_ut_first_cb);
-	/* Check that it is actually posible to change spm_buffer upon `write_page` return */
-	flash_ut__make_ff();
-	flash_ut__strcpy((char *) spm_buffer, data_ut_first_cb);
 }
 #else
 static inline void __text flash_ut(void)
@@ -187,7 +168,7 @@ static void __text usart_ut(void)
 	static const char msg_recv[] = "Data received: ";
 	static const char msg_nr[]   = "Number of characters: ";
 
-	nread = usart_read(usart_buffer, bufsz);
+	nread = usart_read(usart_buffer, bufsz, 0U);
 	csum  = usart_calc_csum(usart_buffer, nread);
 	usart_ut__ushort2ascii(s1, csum);
 	usart_ut__ushort2ascii(s2, nread);
@@ -209,12 +190,32 @@ static inline void __text usart_ut(void)
 }
 #endif
 
-static const uint8_t load_program_ack[]  = ANSWER_ACK;
-static const uint8_t load_program_nack[] = ANSWER_NACK;
+/*
+	Pages handed to flash engine and pages it has written so far.
+	Each counter has a single writer, so no locking is needed.
+ */
+static uint8_t load_program_pages_sent;
+static volatile uint8_t load_program_pages_done;
 
 static void __text load_program_cb(void)
 {
-	may_continue = 0x01U;
+	load_program_pages_done++;
+}
+
+/*
+	@ahead tells that the packet is not loaded yet, so the next one waits
+	in RX ring until it is and has to be left out of the credit.
+ */
+static void __text load_program_answer(uint8_t code, uint16_t offset, uint8_t ahead)
+{
+	struct answer answer;
+
+	answer.code   = code;
+	answer.credit = usart_credit(ahead);
+	answer.offset = offset;
+	answer.csum   = usart_calc_csum((uint8_t *) &answer.credit,
+	                                sizeof(answer) - offsetof(struct answer, credit));
+	usart_write((uint8_t *) &answer, sizeof(answer));
 }
 
 static inline void load_program_wait(void)
@@ -222,82 +223,361 @@ static inline void load_program_wait(void)
 	while (!may_continue) ;
 }
 
-static inline void load_program_wr_page(void)
+static inline uint8_t load_program_pages_inflight(void)
 {
-	load_program_wait();
-	may_continue = 0x00U;
-	write_page(load_program_cb);
+	return (uint8_t) (load_program_pages_sent - load_program_pages_done);
+}
+
+/* Answers with hashes of application pages starting at @addr. See PACKET_HASH */
+static void __text load_program_hashes(uint16_t addr)
+{
+	struct hdr *hdr = (struct hdr *) usart_buffer;
+	uint32_t *hash  = (uint32_t *) &hdr[1];
+	uint8_t n;
+
+	hdr->offset = addr;
+	/* Flash is readable only when it is idle */
+	while (flash_busy()) ;
+	for (n = 0U;
+	     n < PACKET_HASH_PAGES && addr < ((uint16_t) (&__text_start));
+	     n++, addr += ((uint16_t) (&__flash_page)))
+		*(hash++) = page_hash(addr);
+
+	hdr->type   = PACKET_HASH;
+	hdr->filesz = (uint16_t) (&__text_start);
+	hdr->len    = (uint16_t) (((uint8_t *) hash) - usart_buffer);
+	hdr->csum   = usart_calc_csum((uint8_t *) &hdr->len,
+	                              hdr->len - offsetof(struct hdr, len));
+	usart_write(usart_buffer, hdr->len);
+}
+
+/* Answers with error counters of the line. See PACKET_STAT */
+static void __text load_program_stat(void)
+{
+	struct hdr *hdr = (struct hdr *) usart_buffer;
+
+	*((struct line_stat *) &hdr[1]) = usart_stat;
+	hdr->type   = PACKET_STAT;
+	hdr->offset = 0U;
+	hdr->filesz = 0U;
+	hdr->len    = sizeof(*hdr) + sizeof(struct line_stat);
+	hdr->csum   = usart_calc_csum((uint8_t *) &hdr->len,
+	                              hdr->len - offsetof(struct hdr, len));
+	usart_write(usart_buffer, hdr->len);
 }
 
+/* Everything load_program() serves, see PACKET_INFO */
+#define LOAD_PROGRAM_FEATURES    (INFO_LZ | INFO_FILL | INFO_HASH | \
+                                  INFO_CAL | INFO_STAT | INFO_SYNC)
+
+/* Answers with what the device is built with. See PACKET_INFO */
+static void __text load_program_info(void)
+{
+	struct hdr *hdr = (struct hdr *) usart_buffer;
+	struct dev_info *dev = (struct dev_info *) &hdr[1];
+
+	dev->page      = (uint16_t) (&__flash_page);
+	dev->bufsz     = (uint16_t) (usart_buffer_end - usart_buffer);
+	dev->flash     = (uint16_t) (&__text_start);
+	dev->mhz       = (uint8_t) info.frequency;
+	dev->ubrr      = info.usart.ubrr;
+	dev->fuse_low  = info.fuses.low;
+	dev->fuse_high = info.fuses.high;
+	dev->features  = LOAD_PROGRAM_FEATURES;
+	hdr->type      = PACKET_INFO;
+	hdr->offset    = 0U;
+	hdr->filesz    = 0U;
+	hdr->len       = sizeof(*hdr) + sizeof(*dev);
+	hdr->csum      = usart_calc_csum((uint8_t *) &hdr->len,
+	                                 hdr->len - offsetof(struct hdr, len));
+	usart_write(usart_buffer, hdr->len);
+}
+
+/*
+	Upper bound of cycles PACKET_CAL may ask to count. Leaves room for
+	a fast clock, the sum of pulses is 16 bits wide.
+ */
+#define LOAD_PROGRAM_CAL_CYCLES_MAX    0xe000U
+
+/*
+	Calibrates the clock against the host, see PACKET_CAL. OSCCAL moves
+	a step at a time, the datasheet warns against large steps of the running
+	clock, until the error stops decreasing. Then it walks back to the clock
+	the line rate is locked to and the best value goes to EEPROM for setup()
+	to load. The clock is 2 ^ cal_idx MHz.
+ */
+static void __text load_program_cal(const struct cal *cal)
+{
+	struct hdr *hdr = (struct hdr *) usart_buffer;
+	uint16_t nr, low_us, target, sum, diff, best_sum, best_diff, last;
+	uint8_t orig, value, best, step, n;
+	struct cal *answer;
+
+	/* The request is overwritten by the rest of the sync */
+	nr      = cal->nr;
+	low_us  = cal->low_us;
+	target  = low_us << info.cal_idx;
+	/* EEPROM is not written while SPM is busy */
+	while (flash_busy()) ;
+	/* Sync characters are timed on the pin */
+	usart_fini();
+
+	orig      = io_read(osccal);
+	value     = orig;
+	best      = orig;
+	best_sum  = usart_pulses(nr, &last);
+	best_diff = (best_sum > target) ? best_sum - target : target - best_sum;
+	/* Fast clock counts more cycles than the target */
+	step      = (best_sum > target) ? (uint8_t) -1 : 1U;
+	for (n = 0U; n < PACKET_CAL_STEPS; n++) {
+		/* OSCCAL doesn't wrap around */
+		if (value == ((step == 1U) ? 0xffU : 0x00U))
+			break;
+		value += step;
+		io_write(osccal, value);
+		sum    = usart_pulses(nr, &last);
+		diff   = (sum > target) ? sum - target : target - sum;
+		if (diff >= best_diff)
+			break;
+		best      = value;
+		best_sum  = sum;
+		best_diff = diff;
+	}
+	while (value != orig) {
+		value -= step;
+		io_write(osccal, value);
+	}
+	eeprom_write(EEPROM_CAL_DATA + info.cal_idx, best);
+
+	/* Let the rest of the sync pass */
+	usart_drain();
+	/* Data packets follow the answer. Their words would be lost to SPM */
+	eeprom_wait();
+
+	answer         = (struct cal *) &hdr[1];
+	answer->nr     = nr;
+	answer->low_us = low_us;
+	answer->cycles = best_sum;
+	answer->osccal = best;
+	hdr->type      = PACKET_CAL;
+	hdr->offset    = 0U;
+	hdr->filesz    = 0U;
+	hdr->len       = sizeof(*hdr) + sizeof(*answer);
+	hdr->csum      = usart_calc_csum((uint8_t *) &hdr->len,
+	                                 hdr->len - offsetof(struct hdr, len));
+	usart_write(usart_buffer, hdr->len);
+}
+
+/*
+	Loads the word at file offset @off into flash engine.
+	The page is queued for writing as soon as its last word is loaded.
+ */
+static void __text load_program_word(uint16_t off, uint16_t word)
+{
+	const uint16_t pg_off_mask = (uint16_t) (&__page_offset_mask);
+
+	/* Flash engine has a page waiting already. Wait until it goes in */
+	if (!(off & pg_off_mask))
+		while (!can_load_page()) ;
+	load_page_word(off & pg_off_mask, word);
+	/* Was it the last word of the page? */
+	if (!((off + 2U) & pg_off_mask)) {
+		load_program_pages_sent++;
+		write_page(load_program_cb);
+	}
+}
+
+/*
+	Number of idle timeouts we keep answering after the last page is
+	stored. The answer to the last packet may be lost, so the host is
+	given a chance to resend it.
+ */
+#define LOAD_PROGRAM_LINGER    128U
+
+/*
+	Payload is acknowledged before it is loaded only if RX ring takes in
+	what the host sends meanwhile. Loading takes a few dozens of cycles
+	per byte, while a character takes 80 * (UBRR + 1) cycles with U2X.
+	At faster rates the packet is acknowledged once it is loaded.
+ */
+#define LOAD_PROGRAM_EARLY_ACK_UBRR    7U
+
 static void __text __noinline load_program(void)
 {
 	const uint16_t usart_bufsz = (uint16_t) (usart_buffer_end - usart_buffer);
 	const uint16_t pg_off_mask = (uint16_t) (&__page_offset_mask);
-	uint16_t filesz, nr, pld_nr, csum;
+	uint16_t filesz, nr, pld_nr, skip, word;
 	struct hdr *hdr;
-	uint8_t *src, *dst;
+	uint8_t *src, linger, fill, early;
 
 	/* Unknown file size yet */
 	filesz = 0U;
 	/* How many bytes of the file we've received already? */
 	pld_nr = 0U;
-	/* Mark flash module free */
-	load_program_cb();
+	/* Wait for the first packet forever */
+	linger = 0U;
+	word   = 0U;
+
+	/* Tell the host the rate is locked, see SYNC_CHAR */
+	load_program_answer(ANSWER_NACK, pld_nr, 0U);
 
 	while (1) {
-		nr      = usart_read(usart_buffer, usart_bufsz);
-		if (nr <= sizeof(*hdr))
+		nr      = usart_read(usart_buffer, usart_bufsz, linger);
+		/* Nobody resends the last packet anymore */
+		if (!nr)
+			break;
+		if (nr < sizeof(*hdr))
 			goto nack;
 		hdr     = (struct hdr *) usart_buffer;
 		/* Sanity check the header */
 		if (hdr->len != nr)
 			goto nack;
+		/* Check csum correctness. It was summed up on the fly */
+		if (!usart_read_csum_ok(hdr->csum))
+			goto nack;
+		if (hdr->type == PACKET_HASH) {
+			if ((hdr->offset & pg_off_mask) ||
+			    hdr->offset >= ((uint16_t) (&__text_start)))
+				goto nack;
+			load_program_hashes(hdr->offset);
+			continue;
+		}
+		if (hdr->type == PACKET_STAT) {
+			if (nr != sizeof(*hdr))
+				goto nack;
+			load_program_stat();
+			continue;
+		}
+		if (hdr->type == PACKET_INFO) {
+			if (nr != sizeof(*hdr))
+				goto nack;
+			load_program_info();
+			continue;
+		}
+		if (hdr->type == PACKET_SYNC) {
+			if (nr != sizeof(*hdr))
+				goto nack;
+			/*
+				Flash IRQ would be held off while the sync is timed.
+				The host sends it right after the answer.
+			 */
+			while (flash_busy()) ;
+			load_program_answer(ANSWER_ACK, pld_nr, 0U);
+			usart_fini();
+			usart_autobaud();
+			usart_init();
+			goto nack;
+		}
+		if (hdr->type == PACKET_CAL) {
+			if (nr != sizeof(*hdr) + sizeof(struct cal) ||
+			    !((struct cal *) &hdr[1])->nr ||
+			    ((struct cal *) &hdr[1])->low_us >
+			    (LOAD_PROGRAM_CAL_CYCLES_MAX >> info.cal_idx))
+				goto nack;
+			load_program_cal((struct cal *) &hdr[1]);
+			continue;
+		}
+		fill    = hdr->type & PACKET_FILL;
+		if (nr == sizeof(*hdr) ||
+		    (hdr->type & ~(PACKET_LZ | PACKET_FILL)) > PACKET_SEEK ||
+		    ((hdr->type & PACKET_LZ) && fill))
+			goto nack;
 		/* Skip packets with zero filesz field */
 		if (!hdr->filesz)
 			goto nack;
 		/* Further packets should have the same filesz value */
 		if (filesz && hdr->filesz != filesz)
 			goto nack;
-		/* Finally check csum correctness */
-		csum    = usart_calc_csum((uint8_t *) &hdr->len,
-		                          nr - offsetof(struct hdr, len));
-		if (csum != hdr->csum)
+		nr     -= sizeof(*hdr);
+		src     = (uint8_t *) &hdr[1];
+		/* Compressed payload is expanded in place */
+		if ((hdr->type & PACKET_LZ) &&
+		    !(nr = lz_inflate(src, nr, usart_buffer_end)))
 			goto nack;
+		if (fill) {
+			if (nr != sizeof(struct fill))
+				goto nack;
+			/* The value byte stands for all of them */
+			nr   = ((struct fill *) src)->count;
+			src += offsetof(struct fill, value);
+		}
 		/* Check that no extra data is present... */
-		if (nr + pld_nr > sizeof(*hdr) + hdr->filesz)
+		if (hdr->offset > hdr->filesz ||
+		    nr > hdr->filesz - hdr->offset)
 			goto nack;
+		if (hdr->offset > pld_nr) {
+			/* Some packet before this one is lost. The host has to go back */
+			if ((hdr->type & ~(PACKET_LZ | PACKET_FILL)) != PACKET_SEEK ||
+			    ((hdr->offset | pld_nr) & pg_off_mask))
+				goto nack;
+			/* Pages up to this run are left intact */
+			while (flash_busy()) ;
+			seek_page(hdr->offset);
+			pld_nr = hdr->offset;
+		}
 		/* At this stage packet appears to be ok... */
 		filesz  = hdr->filesz;
-		src     = (uint8_t *) (&hdr[1]);
-		dst     = &((uint8_t *) spm_buffer)[pld_nr & pg_off_mask];
-		pld_nr += (nr - sizeof(*hdr));
-		while (src < &usart_buffer[nr]) {
-			*(dst++)     = *(src++);
-			if (dst < ((uint8_t *) spm_buffer_end))
-				continue;
-			load_program_wr_page();
-			dst          = (uint8_t *) spm_buffer;
+		/* Resent payload is acknowledged again but is stored only once */
+		skip    = pld_nr - hdr->offset;
+		if (skip >= nr)
+			goto ack;
+		nr     -= skip;
+		if (!fill)
+			src += skip;
+		/*
+			Nothing may fail from now on, so acknowledge the packet first.
+			The host sends the next one while the words are loaded
+			and RX ring takes it in. With the flash idle here, the payload
+			waits for at most one page write, which the ring covers.
+			Fill may span many pages, so it is acknowledged once loaded.
+		 */
+		while (flash_busy()) ;
+		/* Pages of the packet may be erased before their data is complete */
+		set_erase_limit(pld_nr + nr);
+		early   = !fill && info.usart.ubrr >= LOAD_PROGRAM_EARLY_ACK_UBRR;
+		if (early)
+			load_program_answer(ANSWER_ACK, pld_nr + nr, 1U);
+		/* Words go straight to hardware page buffer */
+		for (; nr; nr--, pld_nr++) {
+			if (!(pld_nr & 1U)) {
+				/* Low byte waits for its pair, maybe in the next packet */
+				word = *src;
+			} else {
+				load_program_word(pld_nr - 1U, word | (((uint16_t) *src) << 8));
+			}
+			if (!fill)
+				src++;
 		}
-		/* We've consumed current packet. Send acknowledgment */
-		usart_write(load_program_ack, sizeof(load_program_ack));
-		/* There are still packets left */
-		if (pld_nr < filesz)
+		if (!early)
+			goto ack;
+		goto done;
+	ack:
+		/* Nothing new in the packet or it is loaded already */
+		load_program_answer(ANSWER_ACK, pld_nr, 0U);
+	done:
+		/* There are still packets left or we are done already */
+		if (pld_nr < filesz || linger)
 			continue;
-		/* No need to flash another page */
-		if (dst == (uint8_t *) spm_buffer)
-			break;
+		/* Keep answering to resent packets for a while */
+		linger  = LOAD_PROGRAM_LINGER;
 		/* Fill the rest of the flash page with 0xFF */
-		while (dst < ((uint8_t *) spm_buffer_end))
-			*(dst++)     = 0xffU;
-		load_program_wr_page();
-		break;
+		skip    = pld_nr;
+		if (skip & 1U) {
+			load_program_word(skip - 1U, word | 0xff00U);
+			skip++;
+		}
+		for (; skip & pg_off_mask; skip += 2U)
+			load_program_word(skip, 0xffffU);
+		continue;
 	nack:
-		usart_write(load_program_nack, sizeof(load_program_nack));
+		load_program_answer(ANSWER_NACK, pld_nr, 0U);
 		continue;
 	}
 
 	/* Wait until any remaining flash operation is complete */
-	load_program_wait();
+	while (load_program_pages_inflight()) ;
+	/* Let the last answers out */
+	usart_fini();
 }
 
 #if !DEBUG
@@ -322,6 +602,7 @@ void __noreturn __head main(void)
 	/* Here we have to wait before proceeding :( */
 	load_program_wait();
 	flash_ut();
+	usart_autobaud();
 	usart_init();
 	load_program();
 #if !DEBUG
@@ -1,9 +1,20 @@
 #include <comp-defs.h>
 #include <board-info.h>
 #include <usart.h>
+#include <proto.h>
+#include <csum.h>
+
+/* Number of idle character times which terminate damaged packet */
+#define USART_IDLE_CHARS    16U
+/*
+	Lower bound of the timeout in Timer0 ticks. Fast rates would make it
+	too short for idle periods counted in timeouts, see usart_read().
+ */
+#define USART_IDLE_TICKS_MIN    32U
 
 void __text usart_init(void)
 {
+	uint16_t timeout;
 	uint8_t flags, high, low;
 	flags = irq_save();
 
@@ -12,6 +23,19 @@ void __text usart_init(void)
 	io_write(ubrrh, high);
 	io_write(ubrrl, low);
 
+	/*
+		Inter-character timeout in Timer0 ticks.
+		With U2X set each bit takes 8 * (UBRR + 1) cycles, so
+		USART_IDLE_CHARS characters of 10 bits are (UBRR + 1) * 5 / 4 ticks
+		of the 1024 prescaler.
+	 */
+	timeout = ((info.usart.ubrr + 1U) * (USART_IDLE_CHARS * 10U * 8U / 256U)) >> 2;
+	if (timeout > 0xffU)
+		timeout = 0xffU;
+	if (timeout < USART_IDLE_TICKS_MIN)
+		timeout = USART_IDLE_TICKS_MIN;
+	info.usart.timer_thres = (uint8_t) timeout;
+
 	/* set U2X */
 	io_write(ucsra, (1U << u2x));
 	/* Async mode, 1 stop bit, No Parity, 8 bit data */
@@ -22,43 +46,148 @@ void __text usart_init(void)
 	irq_restore(flags);
 }
 
+static inline uint8_t __text usart_rxd(void)
+{
+	return io_read(pind) & (1U << pind0);
+}
+
+static inline uint16_t __text usart_cycles(void)
+{
+	uint16_t low;
+
+	/* Reading the low byte latches the high one */
+	low = io_read(tcnt1l);
+	return low | (((uint16_t) io_read(tcnt1h)) << 8);
+}
+
+/*
+	Sums up CPU cycles of @nr low pulses on RXD, SYNC_CHAR makes one of
+	8 bit times per character. The pulse in progress is skipped, it would
+	be measured partially. Only 2 bit times pass between pulses, so the
+	loop does nothing but the sum. The last pulse alone goes to @last.
+	Timer1 counts CPU cycles meanwhile. The receiver must be disabled,
+	RXD is polled as a port pin.
+ */
+uint16_t __text usart_pulses(uint16_t nr, uint16_t *last)
+{
+	uint16_t sum, fall, rise;
+	uint8_t flags;
+
+	/* Timer1: normal mode, no prescaler */
+	io_write(tccr1b, (0U << cs12) | (0U << cs11) | (1U << cs10));
+	flags = irq_save();
+	sum   = 0U;
+	fall  = 0U;
+	rise  = 0U;
+	while (!usart_rxd()) ;
+	for (; nr; nr--) {
+		while (usart_rxd()) ;
+		fall = usart_cycles();
+		while (!usart_rxd()) ;
+		rise = usart_cycles();
+		sum += rise - fall;
+	}
+	irq_restore(flags);
+	/* Stop timer */
+	io_write(tccr1b, (0U << cs12) | (0U << cs11) | (0U << cs10));
+
+	*last = rise - fall;
+	return sum;
+}
+
+/* Sync pulses to measure. The host sends twice as many, see SYNC_NR */
+#define USART_SYNC_NR    (SYNC_NR / 2U)
+
+/*
+	Measures the rate of the line. With U2X set USART_SYNC_NR sync pulses
+	take 512 * (UBRR + 1) cycles. The sum is measured again unless it is
+	within 1/64 of the nearest UBRR, the receiver error the datasheet
+	recommends, and the last pulse agrees with it: the host runs at a rate
+	the clock is unable to produce or it is not sending a sync. Sixteen bits
+	hold the sum down to 9600 bps at 8 MHz.
+ */
+void __text usart_autobaud(void)
+{
+	uint16_t sum, last, ubrr, diff;
+
+	while (1) {
+		sum   = usart_pulses(USART_SYNC_NR, &last);
+		ubrr  = (uint16_t) (sum + 0x100U) >> 9;
+		diff  = ubrr << 9;
+		diff  = (sum > diff) ? sum - diff : diff - sum;
+		if (!ubrr || diff > (sum >> 6))
+			continue;
+		diff  = last * USART_SYNC_NR;
+		diff  = (sum > diff) ? sum - diff : diff - sum;
+		if (diff <= (sum >> 3))
+			break;
+	}
+
+	info.usart.ubrr = ubrr - 1U;
+}
+
+/*
+	Received characters are kept in a ring until usart_read() takes them.
+	Characters to send wait in a queue drained by the UDRE interrupt.
+	Both sizes are powers of 2. Every index has a single writer,
+	so no locking is needed.
+ */
+#define USART_RX_RING_SZ    64U
+#define USART_TX_QUEUE_SZ   16U
+
+static uint8_t usart_rx_ring[USART_RX_RING_SZ];
+static volatile uint8_t usart_rx_head, usart_rx_tail;
+static uint8_t usart_tx_queue[USART_TX_QUEUE_SZ];
+static volatile uint8_t usart_tx_head, usart_tx_tail;
+
 static void __text usart_xmit(uint8_t c)
 {
-	while (!(io_read(ucsra) & (1U << udre))) ;
+	uint8_t flags, head, tmp;
+
+	head = usart_tx_head;
+	tmp  = (head + 1U) & (USART_TX_QUEUE_SZ - 1U);
+	/* Wait until UDRE IRQ makes room */
+	while (tmp == usart_tx_tail) ;
 
-	io_write(udr, c);
+	usart_tx_queue[head] = c;
+	usart_tx_head        = tmp;
+
+	flags = irq_save();
+	/* Unmask UDRE IRQ. The handler masks it again once the queue is drained */
+	tmp  = io_read(ucsrb);
+	tmp |= (1U << udrie);
+	io_write(ucsrb, tmp);
+	irq_restore(flags);
 }
 
 static uint16_t __text usart_recv(void)
 {
-	uint8_t status, byte;
+	uint8_t tail, byte;
 
-	status = io_read(ucsra);
-	if (!(status & (1U << rxc)))
+	tail = usart_rx_tail;
+	if (tail == usart_rx_head)
 		return 0x0000U;
 
-	byte = io_read(udr);
-	/* If framing error occurs fake the received byte */
-	if (status & (1U << fe))
-		byte = 0x00U;
-	/* Some characters were lost...
-	   But this one is valid if no FRAMING ERROR occurs */
-	if (status & (1U << dor)) {
-		;
-	}
-	/* Leave only RX status which is 1 */
-	status &= (1U << rxc);
+	byte          = usart_rx_ring[tail];
+	usart_rx_tail = (tail + 1U) & (USART_RX_RING_SZ - 1U);
 
-	return ((((uint16_t) status) << 8) | ((uint16_t) byte));
+	return (0x0100U | ((uint16_t) byte));
 }
 
+/* This type is atomic */
+static volatile uint8_t usart_read_counter;
+/* Running sum of the packet being read. See usart_read_csum_ok() */
+static uint16_t usart_read_sum;
+/* Errors of the line, see PACKET_STAT. Every counter has a single writer */
+struct line_stat usart_stat;
+
 static void __text usart_timer_start(void)
 {
 	uint8_t flags, tmp;
 	flags = irq_save();
 
-	/* Arm timer0 */
-	io_write(tcnt0, 0x00U);
+	/* Arm timer0. It overflows once the line is idle for timer_thres ticks */
+	io_write(tcnt0, (uint8_t) -info.usart.timer_thres);
 	/* The prescaler operates independently. Reset it now to be in somewhat known state */
 	tmp  = io_read(sfior);
 	tmp |= (1U << psr10);
@@ -98,7 +227,7 @@ static void __text usart_rx_enable(void)
 	flags = irq_save();
 
 	tmp  = io_read(ucsrb);
-	tmp |= (1U << rxen);
+	tmp |= (1U << rxen) | (1U << rxcie);
 	io_write(ucsrb, tmp);
 
 	irq_restore(flags);
@@ -111,30 +240,87 @@ static void __text usart_rx_disable(void)
 
 	/* Disable receiver & flush FIFO */
 	tmp  = io_read(ucsrb);
-	tmp &= (~(1U << rxen));
+	tmp &= (~((1U << rxen) | (1U << rxcie)));
 	io_write(ucsrb, tmp);
 
 	irq_restore(flags);
 }
 
-/* This type is atomic */
-static volatile uint8_t usart_read_counter;
-
 /* Timer/Counter0 Overflow interrupt handler */
 void __interrupt __text usart_read_inc_counter()
 {
 	/* IRQs are disabled */
 	usart_read_counter++;
+	/* Every count stands for one more idle timeout */
+	io_write(tcnt0, (uint8_t) -info.usart.timer_thres);
+}
+
+/* USART Rx Complete interrupt handler */
+void __interrupt __text usart_rx()
+{
+	uint8_t status, byte, head, next;
+
+	/* IRQs are disabled */
+	status = io_read(ucsra);
+	byte   = io_read(udr);
+	/* If framing error occurs fake the received byte */
+	if (status & (1U << fe)) {
+		byte = 0x00U;
+		usart_stat.framing++;
+	}
+	/* Characters before this one were lost */
+	if (status & (1U << dor))
+		usart_stat.overrun++;
+	/* The line is busy. Restart the inter-character timeout */
+	io_write(tcnt0, (uint8_t) -info.usart.timer_thres);
+	usart_read_counter = 0U;
+
+	head = usart_rx_head;
+	next = (head + 1U) & (USART_RX_RING_SZ - 1U);
+	/* Ring is full. The character is lost and the packet fails its checksum */
+	if (next == usart_rx_tail) {
+		usart_stat.overrun++;
+		return;
+	}
+	usart_rx_ring[head] = byte;
+	usart_rx_head       = next;
+}
+
+/* USART Data Register Empty interrupt handler */
+void __interrupt __text usart_udre()
+{
+	uint8_t tail, tmp;
+
+	/* IRQs are disabled */
+	tail = usart_tx_tail;
+	if (tail == usart_tx_head) {
+		tmp  = io_read(ucsrb);
+		tmp &= (~(1U << udrie));
+		io_write(ucsrb, tmp);
+		return;
+	}
+	io_write(udr, usart_tx_queue[tail]);
+	usart_tx_tail = (tail + 1U) & (USART_TX_QUEUE_SZ - 1U);
 }
 
 /*
-	Read upto bufsz characters from USART.
-	The basic design is polling read with timeout.
-	The timeout timer is reset upon each successful reception.
+	Read one packet of upto bufsz characters from USART.
+	The length of the packet is taken from `struct hdr` as soon as
+	the field is received, so the reception ends right after the last byte.
+	The inter-character timeout is only used to recover from damaged headers
+	and lost characters. RXC IRQ restarts it upon each received character.
+	The checksum of the packet is summed up as characters are taken
+	from the ring, see usart_read_csum_ok().
+	If @linger is not zero, the routine returns 0 when nothing arrives
+	for @linger timeouts in a row. Otherwise it waits for the first character
+	forever.
+	The receiver stays enabled on return, so characters which arrive
+	while the caller is busy wait in the ring. IRQs must be enabled.
  */
-uint16_t __text usart_read(uint8_t *buf, uint16_t bufsz)
+uint16_t __text usart_read(uint8_t *buf, uint16_t bufsz, uint8_t linger)
 {
-	uint16_t c, nread;
+	const uint16_t len_end = offsetof(struct hdr, len) + sizeof(uint16_t);
+	uint16_t c, nread, pktsz, sum;
 
 	if (bufsz < 1U)
 		return 0U;
@@ -142,43 +328,85 @@ uint16_t __text usart_read(uint8_t *buf, uint16_t bufsz)
 	/* We are going to need this... */
 	usart_rx_enable();
 
+	sum   = 0U;
+	usart_read_counter = 0U;
+	usart_timer_start();
 	/* Spin until first character is received */
 	while (1) {
 		c    = usart_recv();
-		/* Only possible when no characters received from the hardware */
-		if (!c)
-			continue;
-		*buf = (uint8_t) (c & 0x00ffU);
-		break;
+		/* Only possible when the ring is empty */
+		if (c)
+			break;
+		if (linger && usart_read_counter >= linger) {
+			nread = 0U;
+			goto done;
+		}
 	}
+	*buf  = (uint8_t) (c & 0x00ffU);
 	nread = 1U;
 
-	/* Next steps heavily depend on IRQs enabled */
-	if (bufsz < 2U ||
-	    !((get_flags()) & (1U << bit_i)))
-		goto done;
-
-	/* This outer-inner loop design with identical condition
-	   allows guaranteed timer deinitialization */
-	do {
-		usart_read_counter   = 0U;
-		usart_timer_start();
-		while (usart_read_counter < info.usart.timer_thres) {
-			c            = usart_recv();
-			if (!c)
-				continue;
-			buf[nread++] = (uint8_t) (c & 0x00ffU);
-			if (nread >= bufsz)
-				usart_read_counter = info.usart.timer_thres;
+	/* Until the length is known assume the packet occupies whole buffer */
+	pktsz = bufsz;
+	while (nread < pktsz) {
+		c            = usart_recv();
+		if (!c) {
+			/* The ring is drained and the line is idle for too long */
+			if (usart_read_counter) {
+				usart_stat.timeout++;
+				break;
+			}
+			continue;
 		}
-		usart_timer_stop();
-	} while (usart_read_counter < info.usart.timer_thres);
+		buf[nread]   = (uint8_t) (c & 0x00ffU);
+		/* `hdr->csum` itself is not summed up */
+		if (nread >= offsetof(struct hdr, len))
+			sum      = _csum_add_byte(sum, buf[nread], nread & 1U);
+		nread++;
+		if (nread != len_end)
+			continue;
+		/* Damaged length is left to the timeout */
+		c            = ((struct hdr *) buf)->len;
+		if (c >= sizeof(struct hdr) && c <= bufsz)
+			pktsz = c;
+	}
  done:
-	usart_rx_disable();
+	usart_timer_stop();
+	usart_read_sum = sum;
 
 	return nread;
 }
 
+/*
+	Drops characters until the line is idle for a timeout. Unlike
+	usart_read() it counts nothing, the characters are not a packet.
+	IRQs must be enabled.
+ */
+void __text usart_drain(void)
+{
+	usart_rx_enable();
+
+	usart_read_counter = 0U;
+	usart_timer_start();
+	while (usart_recv() || !usart_read_counter) ;
+	usart_timer_stop();
+}
+
+/*
+	Checks @csum against everything past `hdr->csum` in the last packet
+	usart_read() returned. Failures are counted, see PACKET_STAT.
+ */
+uint8_t __text usart_read_csum_ok(uint16_t csum)
+{
+	uint16_t sum;
+
+	sum = ~usart_read_sum;
+	if (csum == sum)
+		return 1U;
+	usart_stat.csum++;
+
+	return 0U;
+}
+
 void __text usart_write(const uint8_t *buf, uint16_t bufsz)
 {
 	uint16_t i;
@@ -187,24 +415,57 @@ void __text usart_write(const uint8_t *buf, uint16_t bufsz)
 		usart_xmit(buf[i]);
 }
 
-uint16_t __text usart_calc_csum(uint8_t *buf, uint16_t bufsz)
+/* Wait until everything queued is sent and shut the receiver down */
+void __text usart_fini(void)
 {
-	uint32_t sum;
-	uint16_t *ptr;
+	while (usart_tx_tail != usart_tx_head) ;
+	while (!(io_read(ucsra) & (1U << udre))) ;
 
-	ptr = (uint16_t *) buf;
-	sum = 0U;
+	usart_rx_disable();
+}
 
-	while (bufsz > 1U) {
-		sum   += *(ptr++);
-		bufsz -= 2U;
+/*
+	Number of bytes the driver can take in while the caller is busy
+	with the packet it has read, i.e. free room in the RX ring.
+	If @ahead is set, the caller gets busy before it reads the next packet,
+	so that packet goes to the ring too and the rest of it is no credit.
+	Its length is known once its header is in the ring, until then it may
+	take the whole buffer.
+ */
+uint16_t __text usart_credit(uint8_t ahead)
+{
+	const uint16_t bufsz = (uint16_t) (usart_buffer_end - usart_buffer);
+	uint16_t room, nr, len;
+	uint8_t head, tail;
+
+	tail = usart_rx_tail;
+	head = usart_rx_head;
+	room = (uint16_t) ((tail - head - 1U) & (USART_RX_RING_SZ - 1U));
+	if (!ahead)
+		return room;
+
+	nr   = (uint16_t) ((head - tail) & (USART_RX_RING_SZ - 1U));
+	len  = bufsz;
+	if (nr >= offsetof(struct hdr, len) + sizeof(uint16_t)) {
+		tail += offsetof(struct hdr, len);
+		len   = usart_rx_ring[tail & (USART_RX_RING_SZ - 1U)];
+		tail++;
+		len  |= ((uint16_t) usart_rx_ring[tail & (USART_RX_RING_SZ - 1U)]) << 8;
+		/* Damaged length is left to the timeout of usart_read() */
+		if (len < sizeof(struct hdr) || len > bufsz)
+			len = bufsz;
 	}
+	/* The ring holds that much of it already */
+	if (len <= nr)
+		return room;
+	len -= nr;
+	if (room <= len)
+		return 0U;
 
-	if (bufsz > 0U)
-		sum   += *((uint8_t *) ptr);
-
-	while ((sum >> 16))
-		sum    = (sum & 0xffffU) + (sum >> 16);
+	return room - len;
+}
 
-	return ~((uint16_t) sum);
+uint16_t __text usart_calc_csum(uint8_t *buf, uint16_t bufsz)
+{
+	return ~_csum_add(0U, buf, bufsz);
 }
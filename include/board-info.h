@@ -11,14 +11,14 @@ struct board_info {
 	} fuses;
 	int frequency;
 	struct {
+		/* Measured by usart_autobaud() */
 		uint16_t ubrr;
-		enum {
-			bps_9600  = 1,
-			bps_38400 = 2,
-		} bps;
+		/* Inter-character timeout in Timer0 ticks */
 		uint8_t timer_thres;
 	} usart;
 	const uint8_t cal_data[4];
+	/* Clock in use, index of `cal_data` */
+	uint8_t cal_idx;
 };
 
 extern struct board_info info;
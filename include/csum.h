@@ -0,0 +1,17 @@
+#ifndef __CSUM_H
+#define __CSUM_H 1
+
+#include <stdint.h>
+
+/*
+	Adds @byte to ones' complement @sum.
+	@odd tells whether the byte is at odd offset, i.e. it's the high one.
+*/
+uint16_t _csum_add_byte(uint16_t sum, uint8_t byte, uint8_t odd);
+
+/*
+	Adds @nr bytes at @buf to ones' complement @sum.
+*/
+uint16_t _csum_add(uint16_t sum, const uint8_t *buf, uint16_t nr);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef __EEPROM_H
+#define __EEPROM_H 1
+
+#include <io.h>
+
+#define EEPROM_SIZE        0x200U
+/*
+	OSCCAL values the host has calibrated, one per clock in the order
+	of `info.cal_data`. Erased cell (0xff) stands for no calibration.
+	The cells are at the end, the application owns everything below.
+ */
+#define EEPROM_CAL_DATA    (EEPROM_SIZE - 4U)
+
+uint8_t eeprom_read(uint16_t addr);
+void eeprom_write(uint16_t addr, uint8_t value);
+void eeprom_wait(void);
+
+#endif
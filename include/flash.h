@@ -3,7 +3,13 @@
 
 #include <io.h>
 
+uint8_t flash_busy(void);
+uint8_t can_load_page(void);
+void load_page_word(uint16_t offset, uint16_t data);
 void write_page(callback_t cb);
+void set_erase_limit(uint16_t limit);
+void seek_page(uint16_t address);
+uint32_t page_hash(uint16_t address);
 void set_lock_bits(callback_t cb, uint8_t bits);
 
 /* Linker managed buffer */
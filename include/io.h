@@ -21,6 +21,10 @@ enum io_location {
 	osccal = 0x31,
 	sfior  = 0x30,
 	/* skip */
+	tccr1b = 0x2e,
+	tcnt1h = 0x2d,
+	tcnt1l = 0x2c,
+	/* skip */
 	tccr2  = 0x25,
 	tcnt2  = 0x24,
 	ocr2   = 0x23,
@@ -36,6 +40,8 @@ enum io_location {
 	ddra   = 0x1a,
 	pina   = 0x19,
 	/* skip */
+	pind   = 0x10,
+	/* skip */
 	udr    = 0x0c,
 	ucsra  = 0x0b,
 	ucsrb  = 0x0a,
@@ -54,6 +60,13 @@ enum tccr0_bits {
 	foc0   = 7, /* Force Output Compare */
 };
 
+enum tccr1b_bits {
+	cs10   = 0, /* Clock Select */
+	cs11   = 1, /* Clock Select */
+	cs12   = 2, /* Clock Select */
+	/* SKIP */
+};
+
 enum timsk_bits {
 	toie0  = 0, /* Timer/Counter0 Overflow Interrupt Enable */
 	ocie0  = 1, /* Timer/Counter0 Output Compare Match Interrupt Enable */
@@ -97,6 +110,12 @@ enum gicr_bits {
 	int1   = 7, /* External Interrupt Request 1 Enable */
 };
 
+enum pind_bits {
+	pind0  = 0, /* Port D Input Pin, RXD */
+	pind1  = 1, /* Port D Input Pin, TXD */
+	/* SKIP */
+};
+
 enum ucsra_bits {
 	mpcm   = 0, /* Multi-processor Communication Mode */
 	u2x    = 1, /* Double the USART Transmission Speed */
@@ -219,6 +238,21 @@ static inline void io_write(uint8_t adr, uint8_t value)
 	}
 }
 
+/*
+	Two writes to @adr in consecutive cycles, for sequences timed by the
+	hardware like IVCE and then IVSEL. @adr must be a constant
+ */
+static inline void io_write_timed(uint8_t adr, uint8_t first, uint8_t second)
+{
+	asm volatile ( "out %[adr],%[first]\n\t"
+		       "out %[adr],%[second]\n\t"
+		       : /* no output operands */
+		       : [adr] "I" (adr & ((1U << 6) - 1)),
+			 [first] "r" (first),
+			 [second] "r" (second)
+		       : "memory" );
+}
+
 static inline uint8_t get_flags(void)
 {
 	return io_read(sreg);
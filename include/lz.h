@@ -0,0 +1,12 @@
+#ifndef __LZ_H
+#define __LZ_H 1
+
+#include <stdint.h>
+
+/* Shortest and longest match of the format. See `base/lz.c` */
+#define LZ_MATCH_MIN    3U
+#define LZ_MATCH_MAX    (0x7fU + LZ_MATCH_MIN)
+
+uint16_t lz_inflate(uint8_t *buf, uint16_t nr, uint8_t *buf_end);
+
+#endif
@@ -4,26 +4,171 @@
 #include <stdint.h>
 #include <comp-defs.h>
 
+/*
+ * The device doesn't know the rate of the line until the host sends
+ * a run of SYNC_NR characters SYNC_CHAR. It times them and answers
+ * ANSWER_NACK with zero offset once it is able to run at that rate.
+ * Otherwise the host repeats the sync at another rate. Characters which
+ * arrive after the device has locked are NACKed as damaged packets.
+ */
+#define SYNC_CHAR    0x80U
+#define SYNC_NR      16U
+
 /* Header of the UART packet */
 struct hdr {
 	/* IPv4 checksum. Everything below this field is checksummed. */
 	uint16_t csum;
 	/* Length of the current packet */
 	uint16_t len;
+	/* Offset of the payload within the file.
+	   Payloads which the device already has are acknowledged but dropped,
+	   so resending a packet is always safe. */
+	uint16_t offset;
 	/* Size of the file.
 	   File is splitted into several packets.
 	   Must be equal for all packets. */
 	uint16_t filesz;
+	/* PACKET_DATA, PACKET_SEEK, PACKET_HASH, PACKET_CAL, PACKET_STAT,
+	   PACKET_SYNC or PACKET_INFO, maybe with PACKET_LZ or PACKET_FILL */
+	uint8_t type;
 	/* Payload */
 } __packed;
 
+/* Payload continues the file right where the previous one ended */
+#define PACKET_DATA   0x00U
+/*
+ * Payload starts a new run of pages. Pages between the previous run and
+ * this one are left as flash holds them. Both runs must be page aligned,
+ * so only whole pages are skipped.
+ */
+#define PACKET_SEEK   0x01U
 /*
- * AVR MCU is a slave device. It either ACKs or NACKs the received packet.
- * To avoid excessive error recovery we distinguish these two states
- * by number of bytes sent. The exact values are somewhat random.
- * But we stick to convention where `0` indicates success and '-1' -- failure.
+ * Flag of PACKET_DATA and PACKET_SEEK: payload is compressed. See `base/lz.c`.
+ * Offsets and sizes refer to the file, i.e. to the expanded payload.
  */
-#define ANSWER_ACK    { 0x00U }
-#define ANSWER_NACK   { 0xffU, 0xffU }
+#define PACKET_LZ     0x80U
+/*
+ * Flag of PACKET_DATA and PACKET_SEEK: payload is `struct fill`.
+ * The device acknowledges such a packet once the bytes are loaded,
+ * so the host has to allow time for the pages they take.
+ */
+#define PACKET_FILL   0x40U
+/*
+ * Request for hashes of application pages starting at page aligned
+ * `offset`. It has no payload. The device answers with a packet of
+ * the same type and offset: its payload is an array of CRC-32 values
+ * (the one of IEEE 802.3) of upto PACKET_HASH_PAGES pages, and `filesz`
+ * is set to the size of application section. Pages are skipped on equal
+ * hashes alone, so they are that wide.
+ */
+#define PACKET_HASH   0x02U
+/* Short answers survive a noisy line better */
+#define PACKET_HASH_PAGES    16U
+
+/*
+ * Request to calibrate the clock of the device. Its payload is `struct cal`.
+ * Right after it the host sends (PACKET_CAL_STEPS + 2) * (@nr + 2)
+ * characters SYNC_CHAR. The device times runs of @nr of them while it moves
+ * OSCCAL one step at a time, stores the best value in EEPROM and answers
+ * with a packet of the same type once the line is idle. The value is
+ * used since the next reset, the rate of the line is locked to the old one.
+ */
+#define PACKET_CAL    0x03U
+#define PACKET_CAL_STEPS     32U
+
+/* Payload of PACKET_CAL */
+struct cal {
+	/* SYNC_CHARs timed at a time and microseconds RXD is low during them */
+	uint16_t nr;
+	uint16_t low_us;
+	/* Answer: OSCCAL found and CPU cycles counted at it instead of
+	   @low_us * MHz. The host sends zeros. */
+	uint16_t cycles;
+	uint8_t osccal;
+} __packed;
+
+/*
+ * Request for error counters of the line. It has no payload. The device
+ * answers with a packet of the same type, its payload is `struct line_stat`.
+ */
+#define PACKET_STAT   0x04U
+
+/* Payload of PACKET_STAT. Counters wrap around, the host takes differences */
+struct line_stat {
+	/* Characters without a stop bit */
+	uint8_t framing;
+	/* Characters lost since the device didn't take them in time */
+	uint8_t overrun;
+	/* Packets which failed their checksum */
+	uint8_t csum;
+	/* Packets cut short by the idle line */
+	uint8_t timeout;
+} __packed;
+
+/*
+ * Request to change the rate of the line. It has no payload. The device
+ * answers ANSWER_ACK, then it measures the sync as after reset and answers
+ * ANSWER_NACK with the offset it is missing. See SYNC_CHAR.
+ */
+#define PACKET_SYNC   0x05U
+
+/*
+ * Request for what the device is built with. It has no payload. The device
+ * answers with a packet of the same type, its payload is `struct dev_info`.
+ * The host sizes its packets and hash queries by it.
+ */
+#define PACKET_INFO   0x06U
+
+/* Flags of `dev_info.features`: the device serves these flags and requests */
+#define INFO_LZ       0x01U
+#define INFO_FILL     0x02U
+#define INFO_HASH     0x04U
+#define INFO_CAL      0x08U
+#define INFO_STAT     0x10U
+#define INFO_SYNC     0x20U
+
+/* Payload of PACKET_INFO */
+struct dev_info {
+	/* Flash page, packet buffer and application section, in bytes */
+	uint16_t page;
+	uint16_t bufsz;
+	uint16_t flash;
+	/* Clock in MHz and the rate divider in use. Rates are MHz / 8 / (UBRR + 1) */
+	uint8_t mhz;
+	uint16_t ubrr;
+	/* Fuse bits */
+	uint8_t fuse_low;
+	uint8_t fuse_high;
+	/* INFO_LZ, INFO_FILL and so on */
+	uint8_t features;
+} __packed;
+
+/* Payload of PACKET_FILL. File continues with @count bytes equal to @value */
+struct fill {
+	uint16_t count;
+	uint8_t value;
+} __packed;
+
+/*
+ * AVR MCU is a slave device. It either ACKs or NACKs every received packet.
+ * We stick to convention where `0` indicates success and '-1' -- failure.
+ */
+#define ANSWER_ACK    0x00U
+#define ANSWER_NACK   0xffU
+
+/* Answer of the AVR MCU */
+struct answer {
+	/* IPv4 checksum. Everything below this field is checksummed. */
+	uint16_t csum;
+	/* Number of bytes the device is able to buffer while it processes
+	   the packet being received right after this answer.
+	   The host may keep that much data in flight beyond that packet. */
+	uint16_t credit;
+	/* Offset of the first byte of the file the device is missing.
+	   Everything below is acknowledged by this answer (cumulative ACK). */
+	uint16_t offset;
+	/* ANSWER_ACK or ANSWER_NACK */
+	uint8_t code;
+} __packed;
 
 #endif
@@ -2,12 +2,20 @@
 #define __USART_H 1
 
 #include <io.h>
+#include <proto.h>
 
+uint16_t usart_pulses(uint16_t nr, uint16_t *last);
+void usart_autobaud(void);
 void usart_init(void);
-uint16_t usart_read(uint8_t *buf, uint16_t bufsz);
+uint16_t usart_read(uint8_t *buf, uint16_t bufsz, uint8_t linger);
+void usart_drain(void);
 void usart_write(const uint8_t *buf, uint16_t bufsz);
+void usart_fini(void);
+uint8_t usart_read_csum_ok(uint16_t csum);
 uint16_t usart_calc_csum(uint8_t *buf, uint16_t bufsz);
+uint16_t usart_credit(uint8_t ahead);
 
 extern uint8_t usart_buffer[], usart_buffer_end[];
+extern struct line_stat usart_stat;
 
 #endif
@@ -0,0 +1,36 @@
+# Turns tools/link.lds symbols and .bss buffers into assembly for the simulator
+function emit_const(name, expr) {
+	printf("\t.globl\t%s\n\t.set\t%s,(%s) & 0xffff\n", name, name, expr)
+}
+/^PHDRS/ { top = 0 }
+BEGIN { top = 1; printf("/* Generated from tools/link.lds. Do not edit. */\n") }
+top && /^[_a-z][_a-z0-9]*[ \t]*=/ {
+	line = $0
+	sub(/;.*/, "", line)
+	split(line, kv, "=")
+	gsub(/[ \t]/, "", kv[1])
+	emit_const(kv[1], kv[2])
+	next
+}
+/^[ \t]*\.bss/ { bss = 1; printf("\t.bss\n\t.balign\t2\n"); next }
+bss && /^[ \t]*}/ { bss = 0 }
+bss && /^[ \t]*[_a-z][_a-z0-9]*[ \t]*=[ \t]*\.[ \t]*;/ {
+	name = $1
+	printf("\t.globl\t%s\n%s:\n", name, name)
+	next
+}
+bss && /^[ \t]*\.[ \t]*\+=/ {
+	line = $0
+	sub(/^[ \t]*\.[ \t]*\+=/, "", line)
+	sub(/;.*/, "", line)
+	printf("\t.skip\t%s\n", line)
+	next
+}
+/^[ \t]*\.head\.text[ \t]*\(/ {
+	line = $0
+	sub(/^[ \t]*\.head\.text[ \t]*/, "", line)
+	sub(/[ \t]*:.*/, "", line)
+	emit_const("__text_start", line)
+	next
+}
+END { printf("\t.section\t.note.GNU-stack,\"\",@progbits\n") }
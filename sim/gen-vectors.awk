@@ -0,0 +1,18 @@
+# Turns asm/head.S interrupt vector table into C array for the simulator
+/^ivt:/ { inside = 1; n = 0; next }
+inside && /\.size/ { inside = 0 }
+inside && /^[ \t]*int_stub/ { n++; next }
+inside && /^[ \t]*jmp/ {
+	n++
+	if ($2 != "entry") { vec[n] = $2 }
+	next
+}
+END {
+	printf("/* Generated from asm/head.S. Do not edit. */\n")
+	for (i in vec)
+		printf("extern void %s(void);\n", vec[i])
+	printf("void (*const sim_vectors[22])(void) = {\n")
+	for (i in vec)
+		printf("\t[%d] = %s,\n", i, vec[i])
+	printf("};\n")
+}
@@ -0,0 +1,48 @@
+#ifndef __SIM_IO_H
+#define __SIM_IO_H 1
+
+/*
+	Takes the place of `include/io.h` for the host build. Definitions and
+	register names of the real one are kept, the inline assembly it does
+	is renamed out of the way and replaced by functions of `sim/sim.c`.
+ */
+#define cli avr_cli
+#define sei avr_sei
+#define wdr avr_wdr
+#define sleep avr_sleep
+#define lpm avr_lpm
+#define io_read avr_io_read
+#define io_write avr_io_write
+#define io_write_timed avr_io_write_timed
+#define get_flags avr_get_flags
+#define set_flags avr_set_flags
+#define irq_save avr_irq_save
+#define irq_restore avr_irq_restore
+#define die avr_die
+#include_next <io.h>
+#undef cli
+#undef sei
+#undef wdr
+#undef sleep
+#undef lpm
+#undef io_read
+#undef io_write
+#undef io_write_timed
+#undef get_flags
+#undef set_flags
+#undef irq_save
+#undef irq_restore
+#undef die
+void cli(void);
+void sei(void);
+void wdr(void);
+uint8_t lpm(uint16_t adr);
+uint8_t io_read(uint8_t adr);
+void io_write(uint8_t adr, uint8_t value);
+void io_write_timed(uint8_t adr, uint8_t first, uint8_t second);
+uint8_t get_flags(void);
+void set_flags(uint8_t f);
+uint8_t irq_save(void);
+void irq_restore(uint8_t f);
+void die(void) __attribute__((noreturn));
+#endif
@@ -0,0 +1,1121 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/time.h>
+
+#include <io.h>
+
+/*
+	Host-native model of the parts of ATmega16 the bootloader touches.
+	Firmware sources are compiled unchanged; I/O goes through io_read/io_write,
+	SPM through the functions normally living in asm/spm-wrapper.S.
+	Interrupts are delivered from SIGALRM handler, so the firmware may spin
+	on volatile variables exactly as it does on real hardware.
+
+	`make sim` builds it together with the uploader, then
+
+		./sim/avr-sim -p /tmp/avr -o flash.bin &
+		./tools/avr-uploader /tmp/avr program.bin
+
+	flashes the device at the simulated line rate; -o dumps the flash on
+	exit, once pending pages are written. SIM_TRACE in the environment
+	logs every character on the line and how much time the host scheduler
+	has stolen from the device.
+ */
+
+#define FLASH_SIZE     (0x2000U * 2U)
+#define BOOT_START     (0x1c00U * 2U)
+#define PAGE_SIZE      (64U * 2U)
+#define SPM_OP_NS      4000000ULL
+#define TICK_US        20
+#define PULL_NS        (TICK_US * 1000ULL / 4ULL)
+#define STALL_NS       (10ULL * TICK_US * 1000ULL)
+#define POLL_STALL_NS  250ULL
+#define SETTLE_NS      (5ULL * SPM_OP_NS)
+#define TERM_NS        1000000000ULL
+
+enum vector {
+	vec_none = 0,
+	vec_t0_ovf = 10,
+	vec_usart_rxc = 12,
+	vec_usart_udre = 13,
+	vec_usart_txc = 14,
+	vec_ee_rdy = 16,
+	vec_t0_comp = 20,
+	vec_spm_rdy = 21,
+	vec_max = 22,
+};
+
+extern void (*const sim_vectors[vec_max])(void);
+extern void fw_main(void);
+extern uint8_t flash_busy(void);
+
+static uint8_t regs[64];
+static volatile sig_atomic_t in_sim, deferred;
+static uint64_t cpu_hz = 8000000ULL, cpu_nominal = 8000000ULL;
+/*
+	The RC oscillator runs at the nominal clock with OSCCAL at cal_ideal.
+	Each step away changes it by CAL_STEP_PPM.
+ */
+#define CAL_STEP_PPM   6000
+static int cal_ideal = -1;
+
+#define EEPROM_SIZE    512U
+#define EEPROM_WRITE_NS 8500000ULL
+static uint8_t eeprom[EEPROM_SIZE];
+static uint64_t eeprom_done;
+static const char *eeprom_path;
+
+static uint8_t flash[FLASH_SIZE];
+static struct {
+	uint8_t low, high, lock;
+} fuses = { 0xe4U, 0x99U, 0xffU };
+
+static const char *dump_path;
+static int trace;
+static unsigned int err_ppm;
+static unsigned int tx_err_ppm;
+static int pty_fd = -1, pty_slave = -1;
+static volatile sig_atomic_t term;
+
+/*
+	Simulated time follows the host clock, except when the host does not
+	schedule us for a while. Such gaps are cut out, otherwise the peripherals
+	would see firmware which doesn't run for milliseconds.
+ */
+static uint64_t stolen_ns, stolen_max;
+/*
+	While the firmware polls RXD, every loop is an I/O access, so any
+	noticeable gap is the host scheduler. Bit times are a few microseconds
+	at fast rates, so such gaps are cut out too.
+ */
+static int polling;
+
+static uint64_t now_ns(void)
+{
+	static uint64_t last;
+	struct timespec ts;
+	uint64_t real, stall;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	real  = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+	stall = polling ? POLL_STALL_NS : STALL_NS;
+	if (last && real - last > stall) {
+		stolen_ns += real - last - stall;
+		if (real - last > stolen_max)
+			stolen_max = real - last;
+	}
+	last = real;
+
+	return real - stolen_ns;
+}
+
+static void sim_fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(stderr, "SIM: ");
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	exit(2);
+}
+
+/* USART: the wire from the host, the receive FIFO and the transmitter */
+
+static struct {
+	/* Bytes written by the host which are still travelling through the wire */
+	uint8_t wire[8192];
+	unsigned int whead, wtail;
+	uint64_t wire_next;
+	uint8_t fifo[2];
+	unsigned int fifo_nr;
+	uint8_t fifo_st[2];
+	uint16_t ubrr;
+	uint8_t tx_udr, tx_shift;
+	int tx_full, tx_busy;
+	uint64_t tx_done;
+	uint8_t out[8192];
+	unsigned int ohead, otail;
+	uint64_t host_bps;
+} usart;
+
+static uint64_t usart_char_ns(void)
+{
+	uint64_t div;
+
+	div = (regs[ucsra] & (1U << u2x)) ? 8U : 16U;
+	/* 10 bits per character */
+	return (10ULL * div * ((uint64_t) usart.ubrr + 1ULL) * 1000000000ULL) / cpu_hz;
+}
+
+/* Rate of the host end of the line, taken from the pty settings */
+static uint64_t usart_host_bps(void)
+{
+	static const struct {
+		speed_t speed;
+		uint64_t bps;
+	} rates[] = {
+		{ B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+		{ B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+		{ B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 },
+		{ B921600, 921600 }, { B1000000, 1000000 }, { B2000000, 2000000 },
+	};
+	struct termios tios;
+	speed_t speed;
+	unsigned int i;
+
+	if (tcgetattr(pty_fd, &tios))
+		return 0;
+	speed = cfgetospeed(&tios);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].speed == speed)
+			return rates[i].bps;
+	return 0;
+}
+
+static uint64_t usart_wire_ns(void)
+{
+	if (!usart.host_bps)
+		return usart_char_ns();
+	return 10ULL * 1000000000ULL / usart.host_bps;
+}
+
+/*
+	Characters sent at a rate off by more than a few percent are
+	sampled at wrong moments. Both ends see garbage then.
+ */
+static int usart_mismatch(void)
+{
+	uint64_t div, dev;
+
+	if (!usart.host_bps)
+		return 0;
+	div = (regs[ucsra] & (1U << u2x)) ? 8U : 16U;
+	dev = cpu_hz / (div * ((uint64_t) usart.ubrr + 1ULL));
+	return (dev > usart.host_bps ? dev - usart.host_bps : usart.host_bps - dev) * 100ULL
+	       > usart.host_bps * 4ULL;
+}
+
+/* Level of RXD pin: the character on the wire is sent LSB first */
+static uint8_t usart_rxd(uint64_t now)
+{
+	uint64_t start, bit;
+
+	if (usart.whead == usart.wtail)
+		return 1U;
+	start = usart.wire_next - usart_wire_ns();
+	if (now < start)
+		return 1U;
+	bit = ((now - start) * 10ULL) / usart_wire_ns();
+	if (!bit)
+		return 0U;
+	if (bit > 8U)
+		return 1U;
+	return (usart.wire[usart.wtail] >> (bit - 1U)) & 1U;
+}
+
+static void usart_pull_host(uint64_t now)
+{
+	static uint64_t last;
+	uint8_t buf[256];
+	ssize_t n, i;
+
+	/* A syscall per I/O read would be too slow to poll RXD at fast rates */
+	if (now - last < PULL_NS)
+		return;
+	last = now;
+
+	for (;;) {
+		if (((usart.whead + 1U) % sizeof(usart.wire)) == usart.wtail)
+			break;
+		n = read(pty_fd, buf, sizeof(buf));
+		if (n <= 0)
+			break;
+		usart.host_bps = usart_host_bps();
+		for (i = 0; i < n; i++) {
+			if (usart.whead == usart.wtail && usart.wire_next < now)
+				usart.wire_next = now + usart_wire_ns();
+			usart.wire[usart.whead] = buf[i];
+			usart.whead = (usart.whead + 1U) % sizeof(usart.wire);
+		}
+		if ((size_t) n < sizeof(buf))
+			break;
+	}
+}
+
+static void usart_push_host(void)
+{
+	ssize_t n;
+
+	while (usart.otail != usart.ohead) {
+		unsigned int len;
+
+		len = (usart.ohead > usart.otail) ? usart.ohead - usart.otail
+		                                  : sizeof(usart.out) - usart.otail;
+		n = write(pty_fd, &usart.out[usart.otail], len);
+		if (n <= 0)
+			break;
+		usart.otail = (usart.otail + (unsigned int) n) % sizeof(usart.out);
+	}
+}
+
+static void usart_update(uint64_t now)
+{
+	usart_pull_host(now);
+
+	while (usart.whead != usart.wtail && now >= usart.wire_next) {
+		uint8_t c = usart.wire[usart.wtail];
+
+		/*
+			At fast rates several characters fall into one tick. Keep them
+			on the wire until RXC ISR drains FIFO, a real MCU would keep up.
+		 */
+		if (usart.fifo_nr >= 2U && (regs[ucsrb] & (1U << rxen)))
+			break;
+
+		usart.wtail = (usart.wtail + 1U) % sizeof(usart.wire);
+		if (trace)
+			fprintf(stderr, "RX %02x %llu %s%s\n", c, (unsigned long long) (now / 1000ULL),
+			        (regs[ucsrb] & (1U << rxen)) ? "" : "(lost, rx disabled)",
+			        usart.fifo_nr >= 2U ? "(overrun)" : "");
+		if (regs[ucsrb] & (1U << rxen)) {
+			uint8_t st = 0U;
+
+			if (usart_mismatch()) {
+				c  = (uint8_t) rand();
+				st = (rand() & 1) ? (1U << fe) : 0U;
+			}
+
+			if (err_ppm && (unsigned int) (rand() % 1000000) < err_ppm) {
+				/* Damaged character: random bits and framing error */
+				c  ^= (uint8_t) (1U << (rand() % 8));
+				st  = (rand() & 1) ? (1U << fe) : 0U;
+				if (rand() % 4 == 0) {
+					/* Lost altogether */
+					usart.wire_next += usart_wire_ns();
+					continue;
+				}
+			}
+			if (usart.fifo_nr < 2U) {
+				usart.fifo[usart.fifo_nr] = c;
+				usart.fifo_st[usart.fifo_nr] = st;
+				usart.fifo_nr++;
+			} else {
+				usart.fifo_st[1] |= (1U << dor);
+			}
+		}
+		usart.wire_next += usart_wire_ns();
+	}
+	if (usart.whead == usart.wtail && usart.wire_next < now)
+		usart.wire_next = now;
+
+	if (usart.tx_busy && now >= usart.tx_done) {
+		if (trace)
+			fprintf(stderr, "TX %02x %llu\n", usart.tx_shift, (unsigned long long) (now / 1000ULL));
+		if (tx_err_ppm && (unsigned int) (rand() % 1000000) < tx_err_ppm)
+			usart.tx_shift ^= (uint8_t) (1U << (rand() % 8));
+		usart.host_bps = usart_host_bps();
+		if (usart_mismatch())
+			usart.tx_shift = (uint8_t) rand();
+		usart.out[usart.ohead] = usart.tx_shift;
+		usart.ohead = (usart.ohead + 1U) % sizeof(usart.out);
+		usart.tx_busy = 0;
+		regs[ucsra] |= (1U << txc);
+	}
+	if (!usart.tx_busy && usart.tx_full) {
+		usart.tx_shift = usart.tx_udr;
+		usart.tx_full = 0;
+		usart.tx_busy = 1;
+		usart.tx_done = now + usart_char_ns();
+	}
+	usart_push_host();
+}
+
+static uint8_t usart_ucsra(void)
+{
+	uint8_t v = regs[ucsra] & ((1U << u2x) | (1U << mpcm) | (1U << txc));
+
+	if (usart.fifo_nr)
+		v |= (1U << rxc) | usart.fifo_st[0];
+	if (!usart.tx_full)
+		v |= (1U << udre);
+	return v;
+}
+
+static uint8_t usart_read_udr(void)
+{
+	uint8_t c;
+
+	if (!usart.fifo_nr)
+		return 0U;
+	c = usart.fifo[0];
+	usart.fifo[0] = usart.fifo[1];
+	usart.fifo_st[0] = usart.fifo_st[1];
+	usart.fifo_st[1] = 0U;
+	usart.fifo_nr--;
+	return c;
+}
+
+/* Timer0 with its prescaler, TOV0 and OCF0 */
+
+static struct {
+	uint64_t last;
+	uint64_t frac;
+} t0;
+
+static unsigned int t0_prescaler(void)
+{
+	static const unsigned int div[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+	return div[regs[tccr0] & 0x07U];
+}
+
+static void t0_update(uint64_t now)
+{
+	unsigned int presc;
+	uint64_t cycles, ticks;
+
+	presc = t0_prescaler();
+	if (!presc) {
+		t0.last = now;
+		return;
+	}
+	cycles  = ((now - t0.last) * cpu_hz) / 1000000000ULL;
+	if (!cycles)
+		return;
+	t0.last = now;
+	t0.frac += cycles;
+	ticks   = t0.frac / presc;
+	t0.frac %= presc;
+
+	while (ticks) {
+		uint8_t cnt = regs[tcnt0], top;
+		int ctc = (regs[tccr0] & (1U << wgm01)) && !(regs[tccr0] & (1U << wgm00));
+		uint64_t step;
+
+		top  = ctc ? regs[ocr0] : 0xffU;
+		if (cnt >= top) {
+			/* Wrap */
+			regs[tcnt0] = 0U;
+			if (!ctc)
+				regs[tifr] |= (1U << tov0);
+			ticks--;
+			continue;
+		}
+		step = (uint64_t) (top - cnt);
+		if (ticks < step) {
+			if (!ctc && cnt < regs[ocr0] && cnt + ticks >= regs[ocr0])
+				regs[tifr] |= (1U << ocf0);
+			regs[tcnt0] = (uint8_t) (cnt + ticks);
+			break;
+		}
+		regs[tcnt0] = top;
+		if (ctc || regs[ocr0] > cnt)
+			regs[tifr] |= (1U << ocf0);
+		ticks -= step;
+	}
+}
+
+/* Timer1. Only plain counting at CPU clock is modelled, which is what autobaud uses */
+static struct {
+	uint64_t base;
+	uint16_t start;
+	uint8_t temp;
+} t1;
+
+static uint16_t t1_count(uint64_t now)
+{
+	if (!(regs[tccr1b] & 0x07U))
+		return t1.start;
+	return (uint16_t) (t1.start + ((now - t1.base) * cpu_hz) / 1000000000ULL);
+}
+
+/* SPM engine: the page buffer, erase and write take SPM_OP_NS */
+
+static struct {
+	uint8_t buf[PAGE_SIZE];
+	uint8_t written[PAGE_SIZE / 2];
+	int busy;
+	uint64_t done;
+	int rwwsb;
+	enum { op_none, op_erase, op_write, op_lock } op;
+	uint16_t addr;
+	uint8_t bits;
+} spm = { .op = op_none };
+
+static void spm_update(uint64_t now)
+{
+	if (!spm.busy || now < spm.done)
+		return;
+
+	switch (spm.op) {
+	case op_erase:
+		memset(&flash[spm.addr], 0xff, PAGE_SIZE);
+		break;
+	case op_write:
+		{
+			unsigned int i;
+
+			for (i = 0; i < PAGE_SIZE; i++)
+				flash[spm.addr + i] &= spm.buf[i];
+			memset(spm.buf, 0xff, sizeof(spm.buf));
+			memset(spm.written, 0, sizeof(spm.written));
+		}
+		break;
+	case op_lock:
+		fuses.lock &= spm.bits;
+		break;
+	default:
+		break;
+	}
+	spm.op   = op_none;
+	spm.busy = 0;
+	regs[spmcr] &= (uint8_t) ~((1U << spmen) | (1U << pgers) | (1U << pgwrt) | (1U << blbset));
+}
+
+/* Interrupts are taken whenever the firmware touches I/O or SIGALRM comes */
+
+static void sim_update(void)
+{
+	uint64_t now = now_ns();
+
+	usart_update(now);
+	t0_update(now);
+	spm_update(now);
+}
+
+static enum vector sim_pending(void)
+{
+	if ((regs[tifr] & (1U << tov0)) && (regs[timsk] & (1U << toie0)))
+		return vec_t0_ovf;
+	if (usart.fifo_nr && (regs[ucsrb] & (1U << rxcie)))
+		return vec_usart_rxc;
+	if (!usart.tx_full && (regs[ucsrb] & (1U << udrie)))
+		return vec_usart_udre;
+	if ((regs[ucsra] & (1U << txc)) && (regs[ucsrb] & (1U << txcie)))
+		return vec_usart_txc;
+	if ((regs[tifr] & (1U << ocf0)) && (regs[timsk] & (1U << ocie0)))
+		return vec_t0_comp;
+	if (!spm.busy && (regs[spmcr] & (1U << spmie)))
+		return vec_spm_rdy;
+	return vec_none;
+}
+
+static void sim_dispatch(void)
+{
+	enum vector v;
+
+	for (;;) {
+		in_sim++;
+		sim_update();
+		v = (regs[sreg] & (1U << bit_i)) ? sim_pending() : vec_none;
+		if (v == vec_none) {
+			in_sim--;
+			break;
+		}
+		regs[sreg] &= (uint8_t) ~(1U << bit_i);
+		/* Flags cleared by hardware on vector execution */
+		if (v == vec_t0_ovf)
+			regs[tifr] &= (uint8_t) ~(1U << tov0);
+		else if (v == vec_t0_comp)
+			regs[tifr] &= (uint8_t) ~(1U << ocf0);
+		else if (v == vec_usart_txc)
+			regs[ucsra] &= (uint8_t) ~(1U << txc);
+		in_sim--;
+		if (!sim_vectors[v])
+			sim_fatal("no handler for vector %d\n", (int) v);
+		sim_vectors[v]();
+		regs[sreg] |= (1U << bit_i);
+	}
+}
+
+static void sim_enter(void)
+{
+	in_sim++;
+}
+
+static void sim_leave(void)
+{
+	in_sim--;
+	if (!in_sim && deferred) {
+		deferred = 0;
+		sim_dispatch();
+	}
+}
+
+static void sim_settle(void);
+
+static void sim_alarm(int sig)
+{
+	(void) sig;
+
+	if (in_sim) {
+		deferred = 1;
+		return;
+	}
+	sim_dispatch();
+	if (term)
+		sim_settle();
+}
+
+/* What `include/io.h` does on the device */
+
+void cli(void)
+{
+	regs[sreg] &= (uint8_t) ~(1U << bit_i);
+}
+
+void sei(void)
+{
+	regs[sreg] |= (1U << bit_i);
+	sim_dispatch();
+}
+
+void wdr(void)
+{
+}
+
+uint8_t get_flags(void)
+{
+	return regs[sreg];
+}
+
+void set_flags(uint8_t f)
+{
+	regs[sreg] = f;
+	if (f & (1U << bit_i))
+		sim_dispatch();
+}
+
+uint8_t irq_save(void)
+{
+	uint8_t f = get_flags();
+
+	cli();
+	return f;
+}
+
+void irq_restore(uint8_t f)
+{
+	set_flags(f);
+}
+
+static void sim_dump(void)
+{
+	FILE *f;
+
+	if (eeprom_path) {
+		f = fopen(eeprom_path, "wb");
+		if (f) {
+			fwrite(eeprom, 1, sizeof(eeprom), f);
+			fclose(f);
+		}
+	}
+	if (!dump_path)
+		return;
+	f = fopen(dump_path, "wb");
+	if (!f)
+		return;
+	fwrite(flash, 1, BOOT_START, f);
+	fclose(f);
+}
+
+void die(void)
+{
+	fprintf(stderr, "SIM: firmware called die() from %p\n", __builtin_return_address(0));
+	sim_dump();
+	exit(3);
+}
+
+uint8_t lpm(uint16_t adr)
+{
+	uint8_t v;
+
+	sim_enter();
+	sim_update();
+	if (adr >= FLASH_SIZE)
+		sim_fatal("lpm beyond flash: %#x\n", adr);
+	if (adr < BOOT_START && (spm.rwwsb || spm.busy))
+		fprintf(stderr, "SIM: lpm from busy RWW section (%#x)\n", adr);
+	v = flash[adr];
+	sim_leave();
+	return v;
+}
+
+uint8_t io_read(uint8_t adr)
+{
+	uint8_t v;
+
+	adr &= 0x3fU;
+	polling = (adr == pind || adr == tcnt1l || adr == tcnt1h);
+	sim_enter();
+	sim_update();
+	switch (adr) {
+	case ucsra:
+		v = usart_ucsra();
+		break;
+	case udr:
+		v = usart_read_udr();
+		break;
+	case pind:
+		v = (uint8_t) ((regs[pind] & 0xfeU) | usart_rxd(now_ns()));
+		break;
+	case tcnt1l:
+		{
+			uint16_t cnt = t1_count(now_ns());
+
+			/* The high byte is latched for the following read */
+			t1.temp = (uint8_t) (cnt >> 8);
+			v = (uint8_t) cnt;
+		}
+		break;
+	case tcnt1h:
+		v = t1.temp;
+		break;
+	case eecr:
+		v = regs[eecr];
+		if (now_ns() < eeprom_done)
+			v |= (1U << eewe);
+		break;
+	case spmcr:
+		v = regs[spmcr];
+		if (spm.busy)
+			v |= (1U << spmen);
+		if (spm.rwwsb)
+			v |= (1U << rwwsb);
+		break;
+	default:
+		v = regs[adr];
+		break;
+	}
+	sim_leave();
+	return v;
+}
+
+/* Both writes land within the same interrupt-free window, as on the device */
+void io_write_timed(uint8_t adr, uint8_t first, uint8_t second)
+{
+	uint8_t f = irq_save();
+
+	io_write(adr, first);
+	io_write(adr, second);
+	irq_restore(f);
+}
+
+void io_write(uint8_t adr, uint8_t value)
+{
+	adr &= 0x3fU;
+	polling = 0;
+	sim_enter();
+	sim_update();
+	switch (adr) {
+	case ucsra:
+		regs[ucsra] = (regs[ucsra] & (uint8_t) ~((1U << u2x) | (1U << mpcm)))
+		            | (value & ((1U << u2x) | (1U << mpcm)));
+		if (value & (1U << txc))
+			regs[ucsra] &= (uint8_t) ~(1U << txc);
+		break;
+	case ubrrh:
+		/* Shared with UCSRC, URSEL selects */
+		if (!(value & (1U << ursel)))
+			usart.ubrr = (uint16_t) ((usart.ubrr & 0x00ffU) | ((uint16_t) (value & 0x0fU) << 8));
+		break;
+	case ubrrl:
+		usart.ubrr = (uint16_t) ((usart.ubrr & 0x0f00U) | value);
+		break;
+	case udr:
+		if (!usart.tx_full && (regs[ucsrb] & (1U << txen))) {
+			usart.tx_udr = value;
+			usart.tx_full = 1;
+			usart_update(now_ns());
+		}
+		break;
+	case ucsrb:
+		if (!(value & (1U << rxen)))
+			usart.fifo_nr = 0U;
+		regs[ucsrb] = value;
+		break;
+	case tifr:
+		regs[tifr] &= (uint8_t) ~value;
+		break;
+	case tccr1b:
+		{
+			uint64_t now = now_ns();
+
+			t1.start = t1_count(now);
+			t1.base  = now;
+			regs[tccr1b] = value;
+		}
+		break;
+	case tcnt1h:
+		t1.temp = value;
+		break;
+	case tcnt1l:
+		t1.start = (uint16_t) (((uint16_t) t1.temp << 8) | value);
+		t1.base  = now_ns();
+		break;
+	case osccal:
+		{
+			uint64_t now = now_ns();
+
+			/* Timers have counted at the old clock so far */
+			t0_update(now);
+			t1.start = t1_count(now);
+			t1.base  = now;
+			regs[osccal] = value;
+			cpu_hz = (cpu_nominal * (uint64_t) (1000000 + CAL_STEP_PPM * ((int) value - cal_ideal)))
+			         / 1000000ULL;
+		}
+		break;
+	case eecr:
+		{
+			unsigned int a = ((regs[eearh] & 0x01U) << 8) | regs[eearl];
+			uint64_t now = now_ns();
+
+			if (now < eeprom_done)
+				sim_fatal("EEPROM accessed while busy\n");
+			if (value & (1U << eere))
+				regs[eedr] = eeprom[a];
+			if ((value & (1U << eewe)) && (regs[eecr] & (1U << eemwe))) {
+				if (spm.busy)
+					sim_fatal("EEPROM write while SPM is busy\n");
+				eeprom[a]   = regs[eedr];
+				eeprom_done = now + EEPROM_WRITE_NS;
+			}
+			regs[eecr] = value & ((1U << eemwe) | (1U << eerie));
+		}
+		break;
+	case tcnt0:
+		regs[tcnt0] = value;
+		t0.frac = 0U;
+		break;
+	case tccr0:
+		t0.last = now_ns();
+		regs[tccr0] = value;
+		break;
+	case sfior:
+		if (value & (1U << psr10))
+			t0.frac = 0U;
+		regs[sfior] = value & (uint8_t) ~(1U << psr10);
+		break;
+	case spmcr:
+		regs[spmcr] = value & (1U << spmie);
+		break;
+	case sreg:
+		regs[sreg] = value;
+		break;
+	default:
+		regs[adr] = value;
+		break;
+	}
+	sim_leave();
+	if (adr == sreg && (value & (1U << bit_i)))
+		sim_dispatch();
+}
+
+/* What `asm/spm-wrapper.S` does on the device */
+
+static void spm_spin(void)
+{
+	/* The device drops SPM while EEPROM is written */
+	if (now_ns() < eeprom_done)
+		sim_fatal("SPM while EEPROM is written\n");
+	while (spm.busy) {
+		sim_update();
+	}
+}
+
+static void spm_start(int op, uint16_t addr)
+{
+	spm.op   = op;
+	spm.addr = addr & (uint16_t) ~(PAGE_SIZE - 1U);
+	spm.busy = 1;
+	spm.done = now_ns() + SPM_OP_NS;
+	if (op == op_erase || op == op_write) {
+		if (spm.addr >= BOOT_START)
+			sim_fatal("SPM targets boot section: %#x\n", addr);
+		spm.rwwsb = 1;
+	}
+}
+
+void _erase_page(uint16_t flash_addr)
+{
+	uint8_t f = irq_save();
+
+	sim_enter();
+	spm_spin();
+	regs[spmcr] |= (1U << spmie);
+	spm_start(op_erase, flash_addr);
+	sim_leave();
+	irq_restore(f);
+}
+
+void _store_temp_buffer(uint16_t flash_addr, uint16_t data)
+{
+	uint8_t f = irq_save();
+	unsigned int off;
+
+	sim_enter();
+	spm_spin();
+	off = flash_addr & (PAGE_SIZE - 2U);
+	if (!spm.written[off / 2U]) {
+		spm.buf[off]      = (uint8_t) data;
+		spm.buf[off + 1U] = (uint8_t) (data >> 8);
+		spm.written[off / 2U] = 1U;
+	}
+	sim_leave();
+	irq_restore(f);
+}
+
+void _write_page(uint16_t flash_addr)
+{
+	uint8_t f = irq_save();
+
+	sim_enter();
+	spm_spin();
+	regs[spmcr] |= (1U << spmie);
+	spm_start(op_write, flash_addr);
+	sim_leave();
+	irq_restore(f);
+}
+
+void _enable_rww_sect(void)
+{
+	uint8_t f = irq_save();
+
+	sim_enter();
+	spm_spin();
+	spm.rwwsb = 0;
+	memset(spm.buf, 0xff, sizeof(spm.buf));
+	memset(spm.written, 0, sizeof(spm.written));
+	sim_leave();
+	irq_restore(f);
+}
+
+void _set_lock_bits(uint8_t bits)
+{
+	uint8_t f = irq_save();
+
+	sim_enter();
+	spm_spin();
+	regs[spmcr] |= (1U << spmie);
+	spm_start(op_lock, 0U);
+	spm.bits = bits | (1U << 7) | (1U << 6) | (1U << 1) | (1U << 0);
+	sim_leave();
+	irq_restore(f);
+}
+
+static uint8_t fuse_read(uint8_t v)
+{
+	uint8_t f = irq_save();
+
+	sim_enter();
+	spm_spin();
+	sim_leave();
+	irq_restore(f);
+	return v;
+}
+
+uint8_t _get_lock_bits(void)
+{
+	return fuse_read(fuses.lock);
+}
+
+uint8_t _get_lfuse_bits(void)
+{
+	return fuse_read(fuses.low);
+}
+
+uint8_t _get_hfuse_bits(void)
+{
+	return fuse_read(fuses.high);
+}
+
+/* asm/spm-wrapper.S:_spm_isr */
+void _spm_isr(void)
+{
+	extern void spm_handler(void);
+
+	regs[spmcr] &= (uint8_t) ~(1U << spmie);
+	sei();
+	spm_handler();
+	cli();
+}
+
+/* asm/csum.S */
+uint16_t _csum_add_byte(uint16_t sum, uint8_t byte, uint8_t odd)
+{
+	uint32_t s = (uint32_t) sum + ((uint32_t) byte << ((odd & 1U) * 8U));
+
+	return (uint16_t) ((s & 0xffffU) + (s >> 16));
+}
+
+uint16_t _csum_add(uint16_t sum, const uint8_t *buf, uint16_t nr)
+{
+	uint16_t i;
+
+	for (i = 0U; i < nr; i++)
+		sum = _csum_add_byte(sum, buf[i], (uint8_t) (i & 1U));
+	return sum;
+}
+
+/*
+	The uploader may be gone while the last page is still being written.
+	So SIGTERM only asks to stop, and the flash is dumped once the firmware
+	has had nothing to flash for SETTLE_NS, or after TERM_NS anyway.
+ */
+static void sim_term(int sig)
+{
+	(void) sig;
+	term = 1;
+}
+
+static void sim_settle(void)
+{
+	static uint64_t term_ns, idle_ns;
+	uint64_t now = now_ns();
+
+	if (!term_ns)
+		term_ns = now;
+	if (spm.busy || flash_busy())
+		idle_ns = 0;
+	else if (!idle_ns)
+		idle_ns = now;
+	if ((!idle_ns || now - idle_ns < SETTLE_NS) && now - term_ns < TERM_NS)
+		return;
+
+	if (trace)
+		fprintf(stderr, "SIM: stolen %llu us, max stall %llu us\n",
+		        (unsigned long long) (stolen_ns / 1000ULL), (unsigned long long) (stolen_max / 1000ULL));
+	sim_dump();
+	_exit(0);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "USAGE: %s [-l <low fuse>] [-f <flash image>] [-o <flash dump>] [-p <pty link>]\n"
+	        "       [-e <rx error ppm>] [-E <tx error ppm>] [-C <OSCCAL of nominal clock>]\n"
+	        "       [-r <EEPROM image>]\n",
+	        prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *link_path = NULL, *img_path = NULL;
+	struct itimerval it;
+	struct sigaction sa;
+	struct termios tios;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:f:o:p:e:E:C:r:")) != -1) {
+		switch (opt) {
+		case 'l':
+			fuses.low = (uint8_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			img_path = optarg;
+			break;
+		case 'o':
+			dump_path = optarg;
+			break;
+		case 'p':
+			link_path = optarg;
+			break;
+		case 'e':
+			err_ppm = (unsigned int) strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			tx_err_ppm = (unsigned int) strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			cal_ideal = (int) strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			eeprom_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	trace = getenv("SIM_TRACE") != NULL;
+	switch (fuses.low & 0x0fU) {
+	case 0x01U: cpu_hz = 1000000ULL; break;
+	case 0x02U: cpu_hz = 2000000ULL; break;
+	case 0x03U: cpu_hz = 4000000ULL; break;
+	default:    cpu_hz = 8000000ULL; break;
+	}
+	cpu_nominal = cpu_hz;
+	/* Default: the chip matches the table of the firmware */
+	if (cal_ideal < 0)
+		cal_ideal = (cpu_hz <= 2000000ULL) ? 0xa9 : 0xa7;
+	regs[osccal] = (uint8_t) cal_ideal;
+
+	memset(eeprom, 0xff, sizeof(eeprom));
+	if (eeprom_path) {
+		FILE *f = fopen(eeprom_path, "rb");
+
+		if (f) {
+			if (fread(eeprom, 1, sizeof(eeprom), f) == 0 && ferror(f))
+				sim_fatal("can't read %s\n", eeprom_path);
+			fclose(f);
+		}
+	}
+
+	memset(flash, 0xff, sizeof(flash));
+	if (img_path) {
+		FILE *f = fopen(img_path, "rb");
+
+		if (!f)
+			sim_fatal("can't open %s\n", img_path);
+		if (fread(flash, 1, BOOT_START, f) == 0 && ferror(f))
+			sim_fatal("can't read %s\n", img_path);
+		fclose(f);
+	}
+
+	pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty_fd < 0 || grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0)
+		sim_fatal("pty: %s\n", strerror(errno));
+	pty_slave = open(ptsname(pty_fd), O_RDWR | O_NOCTTY);
+	if (pty_slave < 0 || tcgetattr(pty_slave, &tios) < 0)
+		sim_fatal("pty slave: %s\n", strerror(errno));
+	cfmakeraw(&tios);
+	tcsetattr(pty_slave, TCSANOW, &tios);
+	fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL) | O_NONBLOCK);
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(ptsname(pty_fd), link_path) < 0)
+			sim_fatal("symlink: %s\n", strerror(errno));
+	}
+	printf("%s\n", ptsname(pty_fd));
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sim_term;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = sim_alarm;
+	sa.sa_flags   = SA_RESTART;
+	sigaction(SIGALRM, &sa, NULL);
+
+	it.it_interval.tv_sec  = 0;
+	it.it_interval.tv_usec = TICK_US;
+	it.it_value = it.it_interval;
+	setitimer(ITIMER_REAL, &it, NULL);
+
+	fw_main();
+	return 0;
+}
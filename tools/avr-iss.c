@@ -0,0 +1,2078 @@
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <elf.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/*
+	Instruction set simulator of the part of ATmega16 the bootloader runs
+	on. It executes avr-bld.ihex as the Makefile produces it and counts
+	cycles as the datasheet does. Peripherals the firmware touches run off
+	the same cycles: USART with U2X, Timer0 and Timer1 behind the shared
+	prescaler, the SPM engine with its page buffer and erase/write time,
+	fuse and lock bit reads by lpm, EEPROM, OSCCAL and the IVT move via
+	GICR. USART is bridged to a pty and the simulation is held to real
+	time, so avr-uploader talks to it as to a device:
+
+		./tools/avr-iss -s avr-bld.elf -p /tmp/avr avr-bld.ihex &
+		./tools/avr-uploader /tmp/avr program.bin
+
+	SIGINT and SIGTERM print where the cycles went and end it, SIGUSR1
+	prints the same and starts counting anew. Symbols of -s name the
+	functions, otherwise the busiest instructions are listed.
+ */
+
+#define FLASH_SIZE        (0x2000U * 2U)
+#define PC_MASK           (FLASH_SIZE / 2U - 1U)
+#define PAGE_SIZE         (64U * 2U)
+#define RAM_START         0x60U
+#define RAM_END           (RAM_START + 0x400U)
+#define EEPROM_SIZE       512U
+/* Page erase and write take 3.7 to 4.5 ms, EEPROM write 8.5 ms */
+#define SPM_OP_PS         4000000000ULL
+#define EEPROM_WRITE_PS   8500000000ULL
+/* The RC oscillator changes by this much per step of OSCCAL */
+#define CAL_STEP_PPM      6000
+/* The pty, signals and real time are looked at this often */
+#define SYNC_PS           50000000ULL
+/*
+	The simulation runs ahead of real time by no more than AHEAD_NS.
+	If the host doesn't run it for longer than LAG_NS, it doesn't try
+	to catch up, the time is lost for the device as for the line.
+ */
+#define AHEAD_NS          500000LL
+#define LAG_NS            5000000LL
+
+enum io_reg {
+	io_ubrrl  = 0x09,
+	io_ucsrb  = 0x0a,
+	io_ucsra  = 0x0b,
+	io_udr    = 0x0c,
+	io_pind   = 0x10,
+	io_eecr   = 0x1c,
+	io_eedr   = 0x1d,
+	io_eearl  = 0x1e,
+	io_eearh  = 0x1f,
+	/* Shared with UCSRC, URSEL selects */
+	io_ubrrh  = 0x20,
+	io_tcnt1l = 0x2c,
+	io_tcnt1h = 0x2d,
+	io_tccr1b = 0x2e,
+	io_sfior  = 0x30,
+	io_osccal = 0x31,
+	io_tcnt0  = 0x32,
+	io_tccr0  = 0x33,
+	io_mcucr  = 0x35,
+	io_spmcr  = 0x37,
+	io_tifr   = 0x38,
+	io_timsk  = 0x39,
+	io_gicr   = 0x3b,
+	io_ocr0   = 0x3c,
+	io_spl    = 0x3d,
+	io_sph    = 0x3e,
+	io_sreg   = 0x3f,
+};
+
+#define BIT(b)    (1U << (b))
+
+enum sreg_bits { bit_c, bit_z, bit_n, bit_v, bit_s, bit_h, bit_t, bit_i };
+enum ucsra_bits { mpcm, u2x, pe, dor, fe, udre, txc, rxc };
+enum ucsrb_bits { txb8, rxb8, ucsz2, txen, rxen, udrie, txcie, rxcie };
+enum ucsrc_bits { ucpol, ucsz0, ucsz1, usbs, upm0, upm1, umsel, ursel };
+enum timsk_bits { toie0, ocie0, toie1 };
+enum tifr_bits { tov0, ocf0, tov1 };
+enum spmcr_bits { spmen, pgers, pgwrt, blbset, rwwsre, rwwsb = 6, spmie };
+enum eecr_bits { eere, eewe, eemwe, eerie };
+enum gicr_bits { ivce, ivsel };
+#define WGM00     6
+#define WGM01     3
+#define PSR10     0
+#define SE        6
+
+/* Vectors are word addresses from the start of the table, in order of priority */
+enum vector {
+	vec_none    = 0x00,
+	vec_t1_ovf  = 0x10,
+	vec_t0_ovf  = 0x12,
+	vec_rxc     = 0x16,
+	vec_udre    = 0x18,
+	vec_txc     = 0x1a,
+	vec_ee_rdy  = 0x1e,
+	vec_t0_comp = 0x26,
+	vec_spm_rdy = 0x28,
+};
+
+static uint8_t flash[FLASH_SIZE];
+static uint8_t reg[32];
+static uint8_t io[64];
+static uint8_t sram[RAM_END - RAM_START];
+static uint8_t eeprom[EEPROM_SIZE];
+
+/*
+	The BOOTRST fuse is programmed and BOOTSZ gives 1024 words to the
+	bootloader, as tools/link.lds expects.
+ */
+static struct {
+	uint8_t low, high, lock;
+} fuses = { 0xe4U, 0x98U, 0xffU };
+static uint16_t boot_start;
+
+/* Program counter in words */
+static uint16_t pc;
+/* Cycles since reset and simulated time they took, the clock may change */
+static uint64_t cyc, now_ps, cycle_ps;
+static uint64_t cpu_hz, cpu_nominal;
+static int cal_ideal = -1;
+/* Peripherals want a look when cyc reaches this */
+static uint64_t next_cyc;
+static enum vector pending;
+/* SEI and RETI let one more instruction run before an interrupt */
+static int irq_hold;
+/* GICR holds interrupts off until this cycle while IVCE is set */
+static uint64_t ivce_until;
+static int sleeping;
+
+static const char *dump_path, *eeprom_path;
+static unsigned int err_ppm, tx_err_ppm;
+static int pty_fd = -1, pty_slave = -1;
+static volatile sig_atomic_t got_quit, got_report;
+
+/* Where the cycles go, see report() */
+static struct {
+	uint64_t cycles[FLASH_SIZE / 2U];
+	uint32_t hits[FLASH_SIZE / 2U];
+	/* Longest window with interrupts off, by the instruction which began it */
+	uint32_t irq_off[FLASH_SIZE / 2U];
+	uint64_t start_cyc, start_ps;
+	/* Real time the host didn't run us for, see host_sync() */
+	uint64_t lost_ns;
+	unsigned long rx, tx, overruns, frame_errors, rww_reads;
+} prof;
+static uint64_t irq_off_since;
+static uint16_t irq_off_pc;
+
+static struct symbol {
+	uint16_t addr;
+	const char *name;
+} *symbols;
+static unsigned int symbols_nr;
+
+static void iss_fatal(const char *msg, ...) __attribute__((noreturn, format(printf, 1, 2)));
+static void host_flush(void);
+
+static void dump_files(void)
+{
+	FILE *f;
+
+	if (eeprom_path && (f = fopen(eeprom_path, "wb"))) {
+		fwrite(eeprom, 1, sizeof(eeprom), f);
+		fclose(f);
+	}
+	if (dump_path && (f = fopen(dump_path, "wb"))) {
+		fwrite(flash, 1, (size_t) boot_start * 2U, f);
+		fclose(f);
+	}
+}
+
+static void iss_fatal(const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	fprintf(stderr, "ISS: ");
+	vfprintf(stderr, msg, ap);
+	va_end(ap);
+	if (pty_fd >= 0)
+		host_flush();
+	dump_files();
+	exit(2);
+}
+
+/* Name of the function @addr is in, as "name+0x12" */
+static const char *symbol_name(uint16_t addr)
+{
+	static char buf[2][64];
+	static unsigned int idx;
+	unsigned int lo = 0, hi = symbols_nr;
+	char *s = buf[idx++ & 1U];
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2U;
+
+		if (symbols[mid].addr <= addr)
+			lo = mid + 1U;
+		else
+			hi = mid;
+	}
+	if (!lo)
+		snprintf(s, sizeof(buf[0]), "0x%04x", addr);
+	else if (addr == symbols[lo - 1U].addr)
+		snprintf(s, sizeof(buf[0]), "%s", symbols[lo - 1U].name);
+	else
+		snprintf(s, sizeof(buf[0]), "%s+0x%x", symbols[lo - 1U].name,
+		         (unsigned int) (addr - symbols[lo - 1U].addr));
+	return s;
+}
+
+static int symbol_cmp(const void *a, const void *b)
+{
+	const struct symbol *x = a, *y = b;
+
+	return (int) x->addr - (int) y->addr;
+}
+
+/* Takes function symbols of the ELF file the ihex was made of */
+static void load_symbols(const char *path)
+{
+	const Elf32_Ehdr *eh;
+	const Elf32_Shdr *sh;
+	struct stat st;
+	const char *ptr;
+	unsigned int i, j;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+		iss_fatal("%s: %s\n", path, strerror(errno));
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		iss_fatal("%s: %s\n", path, strerror(errno));
+
+	eh = (const Elf32_Ehdr *) ptr;
+	if ((size_t) st.st_size < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS32 || eh->e_shentsize != sizeof(*sh) ||
+	    eh->e_shoff + (size_t) eh->e_shnum * sizeof(*sh) > (size_t) st.st_size)
+		iss_fatal("%s: not a 32 bit ELF file\n", path);
+	sh = (const Elf32_Shdr *) (ptr + eh->e_shoff);
+
+	for (i = 0; i < eh->e_shnum; i++) {
+		const Elf32_Sym *sym = (const Elf32_Sym *) (ptr + sh[i].sh_offset);
+		const char *strings;
+		unsigned int nr = sh[i].sh_size / sizeof(*sym);
+
+		if (sh[i].sh_type != SHT_SYMTAB || sh[i].sh_link >= eh->e_shnum)
+			continue;
+		if (sh[i].sh_offset + sh[i].sh_size > (size_t) st.st_size ||
+		    sh[sh[i].sh_link].sh_offset + sh[sh[i].sh_link].sh_size > (size_t) st.st_size)
+			iss_fatal("%s: section %u is truncated\n", path, i);
+		strings = ptr + sh[sh[i].sh_link].sh_offset;
+		symbols = realloc(symbols, (symbols_nr + nr) * sizeof(*symbols));
+		if (!symbols)
+			iss_fatal("%s\n", strerror(ENOMEM));
+		for (j = 1; j < nr; j++) {
+			if (ELF32_ST_TYPE(sym[j].st_info) != STT_FUNC || sym[j].st_value >= FLASH_SIZE)
+				continue;
+			symbols[symbols_nr].addr = (uint16_t) (sym[j].st_value / 2U);
+			symbols[symbols_nr].name = strings + sym[j].st_name;
+			symbols_nr++;
+		}
+	}
+	if (!symbols_nr)
+		iss_fatal("%s: no function symbols\n", path);
+	qsort(symbols, symbols_nr, sizeof(*symbols), symbol_cmp);
+	/* Aliases share the first name */
+	for (i = 1, j = 1; i < symbols_nr; i++)
+		if (symbols[i].addr != symbols[j - 1U].addr)
+			symbols[j++] = symbols[i];
+	symbols_nr = j;
+}
+
+/* Value of @nr hex digits at @s, or -1 */
+static long hex_value(const char *s, unsigned int nr)
+{
+	long value = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (s[i] >= '0' && s[i] <= '9')
+			value = value * 16 + s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			value = value * 16 + s[i] - 'a' + 10;
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			value = value * 16 + s[i] - 'A' + 10;
+		else
+			return -1;
+	}
+
+	return value;
+}
+
+/* Loads data records of Intel HEX file into the flash */
+static void load_ihex(const char *path)
+{
+	uint8_t rec[5 + 0xff];
+	unsigned long base = 0, addr;
+	unsigned int line = 0, nr, i, sum;
+	char buf[2 * sizeof(rec) + 8], *s;
+	long value;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		iss_fatal("%s: %s\n", path, strerror(errno));
+	while (fgets(buf, sizeof(buf), f)) {
+		line++;
+		s = buf + strcspn(buf, "\r\n");
+		*s = '\0';
+		if (!buf[0])
+			continue;
+		if (buf[0] != ':' || (value = hex_value(buf + 1, 2)) < 0 ||
+		    strlen(buf) != 1U + (unsigned long) (value + 5) * 2U)
+			iss_fatal("%s: line %u is malformed\n", path, line);
+		/* Length, address, type, data and checksum */
+		nr  = value + 5;
+		sum = 0;
+		for (i = 0; i < nr; i++) {
+			if ((value = hex_value(buf + 1 + i * 2, 2)) < 0)
+				iss_fatal("%s: line %u is malformed\n", path, line);
+			rec[i] = value;
+			sum   += value;
+		}
+		if (sum & 0xffU)
+			iss_fatal("%s: line %u fails its checksum\n", path, line);
+		switch (rec[3]) {
+		case 0x00:
+			addr = base + (rec[1] << 8 | rec[2]);
+			if (addr + rec[0] > FLASH_SIZE)
+				iss_fatal("%s: line %u is beyond the flash\n", path, line);
+			memcpy(&flash[addr], &rec[4], rec[0]);
+			break;
+		case 0x01:
+			fclose(f);
+			return;
+		case 0x02:
+		case 0x04:
+			if (rec[0] != 2)
+				iss_fatal("%s: line %u is malformed\n", path, line);
+			base = (unsigned long) (rec[4] << 8 | rec[5]) << ((rec[3] == 0x02) ? 4 : 16);
+			break;
+		case 0x03:
+		case 0x05:
+			break;
+		default:
+			iss_fatal("%s: line %u has unknown type 0x%02x\n", path, line, rec[3]);
+		}
+	}
+	iss_fatal("%s: no end of file record\n", path);
+}
+
+static uint64_t ps_to_cycles(uint64_t ps)
+{
+	return (ps + cycle_ps - 1U) / cycle_ps;
+}
+
+static void set_clock(uint64_t hz)
+{
+	cpu_hz   = hz;
+	cycle_ps = 1000000000000ULL / hz;
+}
+
+/* USART: the wire from the host, the receive FIFO and the transmitter */
+
+static struct {
+	/* Characters the host has written, on their way through RXD */
+	uint8_t wire[8192];
+	unsigned int whead, wtail;
+	/* The character at wtail has passed RXD by then */
+	uint64_t wire_end;
+	uint64_t host_bps;
+	/* Two characters of the FIFO and the one waiting in the shift register */
+	uint8_t fifo[3], fifo_st[3];
+	unsigned int fifo_nr;
+	uint16_t ubrr;
+	uint8_t ucsrc;
+	uint8_t tx_udr, tx_shift;
+	int tx_full, tx_busy;
+	uint64_t tx_done;
+	uint8_t out[8192];
+	unsigned int ohead, otail;
+} usart;
+
+/* Bits of a character with the frame UCSRC sets */
+static unsigned int usart_frame_bits(void)
+{
+	unsigned int bits = 1U + 5U + ((usart.ucsrc >> ucsz0) & 3U) + 1U;
+
+	if (usart.ucsrc & BIT(upm1))
+		bits++;
+	if (usart.ucsrc & BIT(usbs))
+		bits++;
+	return bits;
+}
+
+static uint64_t usart_char_cycles(void)
+{
+	uint64_t div = (io[io_ucsra] & BIT(u2x)) ? 8U : 16U;
+
+	return usart_frame_bits() * div * ((uint64_t) usart.ubrr + 1U);
+}
+
+/* Rate of the host end of the line, taken from the pty settings */
+static uint64_t usart_host_bps(void)
+{
+	static const struct {
+		speed_t speed;
+		uint64_t bps;
+	} rates[] = {
+		{ B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 },
+		{ B38400, 38400 }, { B57600, 57600 }, { B115200, 115200 },
+		{ B230400, 230400 }, { B460800, 460800 }, { B500000, 500000 },
+		{ B921600, 921600 }, { B1000000, 1000000 }, { B2000000, 2000000 },
+	};
+	struct termios tios;
+	speed_t speed;
+	unsigned int i;
+
+	if (tcgetattr(pty_fd, &tios))
+		return 0;
+	speed = cfgetospeed(&tios);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+		if (rates[i].speed == speed)
+			return rates[i].bps;
+	return 0;
+}
+
+/* Time a character of the host takes on the wire */
+static uint64_t usart_wire_ps(void)
+{
+	if (!usart.host_bps)
+		return usart_char_cycles() * cycle_ps;
+	return 10ULL * 1000000000000ULL / usart.host_bps;
+}
+
+/*
+	Characters sent at a rate off by more than a few percent are
+	sampled at wrong moments. Both ends see garbage then.
+ */
+static int usart_mismatch(void)
+{
+	uint64_t div, dev;
+
+	if (!usart.host_bps)
+		return 0;
+	div = (io[io_ucsra] & BIT(u2x)) ? 8U : 16U;
+	dev = cpu_hz / (div * ((uint64_t) usart.ubrr + 1ULL));
+	return (dev > usart.host_bps ? dev - usart.host_bps : usart.host_bps - dev) * 100ULL
+	       > usart.host_bps * 4ULL;
+}
+
+/* Level of RXD pin: the character on the wire is sent LSB first */
+static uint8_t usart_rxd(void)
+{
+	uint64_t start, bit;
+
+	if (usart.whead == usart.wtail)
+		return 1U;
+	start = usart.wire_end - usart_wire_ps();
+	if (now_ps < start)
+		return 1U;
+	bit = ((now_ps - start) * 10ULL) / usart_wire_ps();
+	if (!bit)
+		return 0U;
+	if (bit > 8U)
+		return 1U;
+	return (usart.wire[usart.wtail] >> (bit - 1U)) & 1U;
+}
+
+static void usart_receive(uint8_t c)
+{
+	uint8_t st = 0U;
+
+	if (usart_mismatch()) {
+		c  = (uint8_t) rand();
+		st = (rand() & 1) ? BIT(fe) : 0U;
+	}
+	if (err_ppm && (unsigned int) (rand() % 1000000) < err_ppm) {
+		/* Damaged character: random bits and framing error */
+		c  ^= (uint8_t) (1U << (rand() % 8));
+		st  = (rand() & 1) ? BIT(fe) : 0U;
+		/* Or lost altogether */
+		if (rand() % 4 == 0)
+			return;
+	}
+	if (st & BIT(fe))
+		prof.frame_errors++;
+	if (usart.fifo_nr == 3U) {
+		/* The next start bit finds the FIFO and the shift register full */
+		usart.fifo_st[2] |= BIT(dor);
+		prof.overruns++;
+		return;
+	}
+	usart.fifo[usart.fifo_nr]    = c;
+	usart.fifo_st[usart.fifo_nr] = st;
+	usart.fifo_nr++;
+	prof.rx++;
+}
+
+static void usart_update(void)
+{
+	while (usart.whead != usart.wtail && now_ps >= usart.wire_end) {
+		if (io[io_ucsrb] & BIT(rxen))
+			usart_receive(usart.wire[usart.wtail]);
+		usart.wtail = (usart.wtail + 1U) % sizeof(usart.wire);
+		if (usart.whead != usart.wtail)
+			usart.wire_end += usart_wire_ps();
+	}
+
+	while (usart.tx_busy && cyc >= usart.tx_done) {
+		if (tx_err_ppm && (unsigned int) (rand() % 1000000) < tx_err_ppm)
+			usart.tx_shift ^= (uint8_t) (1U << (rand() % 8));
+		if (usart_mismatch())
+			usart.tx_shift = (uint8_t) rand();
+		usart.out[usart.ohead] = usart.tx_shift;
+		usart.ohead = (usart.ohead + 1U) % sizeof(usart.out);
+		usart.tx_busy = 0;
+		prof.tx++;
+		/* The next character follows the stop bit, TXC waits for the last one */
+		if (usart.tx_full) {
+			usart.tx_shift = usart.tx_udr;
+			usart.tx_full  = 0;
+			usart.tx_busy  = 1;
+			usart.tx_done += usart_char_cycles();
+		} else {
+			io[io_ucsra] |= BIT(txc);
+		}
+	}
+}
+
+static void usart_write_udr(uint8_t value)
+{
+	if (usart.tx_full || !(io[io_ucsrb] & BIT(txen)))
+		return;
+	if (usart.tx_busy) {
+		usart.tx_udr  = value;
+		usart.tx_full = 1;
+		return;
+	}
+	usart.tx_shift = value;
+	usart.tx_busy  = 1;
+	usart.tx_done  = cyc + usart_char_cycles();
+}
+
+static uint8_t usart_ucsra(void)
+{
+	uint8_t v = io[io_ucsra] & (BIT(u2x) | BIT(mpcm) | BIT(txc));
+
+	if (usart.fifo_nr)
+		v |= BIT(rxc) | usart.fifo_st[0];
+	if (!usart.tx_full)
+		v |= BIT(udre);
+	return v;
+}
+
+static uint8_t usart_read_udr(void)
+{
+	uint8_t c;
+
+	if (!usart.fifo_nr)
+		return 0U;
+	c = usart.fifo[0];
+	usart.fifo_nr--;
+	memmove(&usart.fifo[0], &usart.fifo[1], usart.fifo_nr);
+	memmove(&usart.fifo_st[0], &usart.fifo_st[1], usart.fifo_nr);
+	return c;
+}
+
+/* Timer0 and Timer1 count ticks of the prescaler they share */
+
+static struct {
+	/* Cycles counted by the prescaler, modulo the largest divisor */
+	unsigned int presc;
+	/* Cycle the timers are brought up to */
+	uint64_t last;
+	uint16_t tcnt1;
+	/* TEMP register of 16 bit accesses */
+	uint8_t temp;
+} tm;
+
+static const unsigned int presc_div[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+static uint64_t presc_ticks(unsigned int div, uint64_t cycles)
+{
+	return div ? (tm.presc % div + cycles) / div : 0U;
+}
+
+/* Cycles until the @nr-th tick of the prescaler at @div */
+static uint64_t presc_cycles(unsigned int div, uint64_t nr)
+{
+	return (uint64_t) (div - tm.presc % div) + (nr - 1U) * div;
+}
+
+static int t0_ctc(void)
+{
+	return (io[io_tccr0] & BIT(WGM01)) && !(io[io_tccr0] & BIT(WGM00));
+}
+
+/* Ticks until OCR0 matches, the counter clears after it in CTC mode */
+static uint64_t t0_to_match(uint8_t cnt)
+{
+	uint8_t ocr = io[io_ocr0];
+
+	if (t0_ctc() && cnt <= ocr)
+		return (cnt == ocr) ? (uint64_t) ocr + 1U : (uint64_t) (ocr - cnt);
+	return (cnt == ocr) ? 256U : (uint64_t) (uint8_t) (ocr - cnt);
+}
+
+static void t0_count(uint64_t ticks)
+{
+	uint8_t cnt = io[io_tcnt0], ocr = io[io_ocr0];
+
+	if (!ticks)
+		return;
+	if (ticks >= t0_to_match(cnt))
+		io[io_tifr] |= BIT(ocf0);
+	if (t0_ctc() && cnt <= ocr) {
+		io[io_tcnt0] = (uint8_t) ((cnt + ticks) % ((uint64_t) ocr + 1U));
+		return;
+	}
+	if (cnt + ticks > 0xffU) {
+		io[io_tifr] |= BIT(tov0);
+		if (t0_ctc()) {
+			/* Wrapped to the bottom, and counts up to OCR0 from there */
+			ticks -= 0x100U - cnt;
+			io[io_tcnt0] = (uint8_t) (ticks % ((uint64_t) ocr + 1U));
+			return;
+		}
+	}
+	io[io_tcnt0] = (uint8_t) (cnt + ticks);
+}
+
+static void timers_update(void)
+{
+	uint64_t cycles = cyc - tm.last, ticks;
+
+	if (!cycles)
+		return;
+	tm.last = cyc;
+	t0_count(presc_ticks(presc_div[io[io_tccr0] & 0x07U], cycles));
+	ticks = presc_ticks(presc_div[io[io_tccr1b] & 0x07U], cycles);
+	if (tm.tcnt1 + ticks > 0xffffU)
+		io[io_tifr] |= BIT(tov1);
+	tm.tcnt1 = (uint16_t) (tm.tcnt1 + ticks);
+	tm.presc = (unsigned int) ((tm.presc + cycles) % 1024U);
+}
+
+/* SPM engine and the fuse reads it shares SPMCR with */
+
+static struct {
+	uint8_t buf[PAGE_SIZE];
+	uint8_t loaded[PAGE_SIZE / 2U];
+	/* SPMCR as written, and the cycle it is written at */
+	uint8_t spmcr;
+	uint64_t written;
+	int busy, rwwsb;
+	uint64_t done;
+	uint16_t addr;
+	/* Reads of the busy RWW section are reported once */
+	int warned;
+} spm;
+
+/* SPM must follow the write of SPMEN within four cycles, LPM within three */
+static int spm_armed(unsigned int window)
+{
+	return (spm.spmcr & BIT(spmen)) && cyc - spm.written < window;
+}
+
+static void spm_update(void)
+{
+	if (!spm.busy || now_ps < spm.done)
+		return;
+	if (spm.spmcr & BIT(pgers)) {
+		memset(&flash[spm.addr], 0xff, PAGE_SIZE);
+	} else {
+		unsigned int i;
+
+		for (i = 0; i < PAGE_SIZE; i++)
+			flash[spm.addr + i] &= spm.buf[i];
+		memset(spm.buf, 0xff, sizeof(spm.buf));
+		memset(spm.loaded, 0, sizeof(spm.loaded));
+	}
+	spm.busy  = 0;
+	spm.spmcr = 0U;
+}
+
+static uint8_t spm_read_spmcr(void)
+{
+	uint8_t v = io[io_spmcr] & BIT(spmie);
+
+	if (spm.busy || spm_armed(4U))
+		v |= spm.spmcr;
+	if (spm.rwwsb)
+		v |= BIT(rwwsb);
+	return v;
+}
+
+static void spm_exec(void)
+{
+	uint16_t z = (uint16_t) (reg[30] | reg[31] << 8);
+	uint8_t op;
+
+	if (spm.busy || !spm_armed(4U))
+		return;
+	op = spm.spmcr & (BIT(pgers) | BIT(pgwrt) | BIT(blbset) | BIT(rwwsre));
+	switch (op) {
+	case BIT(pgers):
+	case BIT(pgwrt):
+		spm.addr = z & (uint16_t) ~(PAGE_SIZE - 1U);
+		if (spm.addr >= boot_start * 2U)
+			iss_fatal("SPM targets boot section: %#x at %s\n", z, symbol_name(pc));
+		spm.busy  = 1;
+		spm.rwwsb = 1;
+		spm.done  = now_ps + SPM_OP_PS;
+		return;
+	case BIT(blbset):
+		fuses.lock &= reg[0];
+		break;
+	case BIT(rwwsre):
+		spm.rwwsb = 0;
+		memset(spm.buf, 0xff, sizeof(spm.buf));
+		memset(spm.loaded, 0, sizeof(spm.loaded));
+		break;
+	case 0:
+		/* A word goes into the page buffer once until it is written or cleared */
+		z &= PAGE_SIZE - 2U;
+		if (!spm.loaded[z / 2U]) {
+			spm.buf[z]      = reg[0];
+			spm.buf[z + 1U] = reg[1];
+			spm.loaded[z / 2U] = 1U;
+		}
+		break;
+	default:
+		iss_fatal("SPM with SPMCR %#x at %s\n", spm.spmcr, symbol_name(pc));
+	}
+	spm.spmcr = 0U;
+}
+
+static uint8_t spm_lpm(uint16_t z)
+{
+	if (spm_armed(3U) && (spm.spmcr & BIT(blbset))) {
+		spm.spmcr = 0U;
+		switch (z) {
+		case 0x0000U:
+			return fuses.low;
+		case 0x0001U:
+			return fuses.lock;
+		case 0x0003U:
+			return fuses.high;
+		default:
+			return 0xffU;
+		}
+	}
+	if (z >= FLASH_SIZE)
+		iss_fatal("lpm beyond flash: %#x at %s\n", z, symbol_name(pc));
+	if (z < boot_start * 2U && spm.rwwsb) {
+		if (!spm.warned++)
+			fprintf(stderr, "ISS: lpm from busy RWW section: %#x at %s\n", z, symbol_name(pc));
+		prof.rww_reads++;
+		return 0xffU;
+	}
+	return flash[z];
+}
+
+/* EEPROM */
+
+static struct {
+	/* EEMWE is set at this cycle and lets EEWE in for four cycles */
+	uint64_t mwe;
+	uint64_t done;
+} ee;
+
+/* Returns the cycles CPU is halted for */
+static unsigned int ee_write_eecr(uint8_t value)
+{
+	unsigned int a = ((io[io_eearh] & 0x01U) << 8) | io[io_eearl];
+
+	if (now_ps < ee.done)
+		iss_fatal("EEPROM accessed while busy at %s\n", symbol_name(pc));
+	io[io_eecr] = value & (BIT(eemwe) | BIT(eerie));
+	if (value & BIT(eere)) {
+		io[io_eedr] = eeprom[a];
+		return 4U;
+	}
+	if ((value & BIT(eewe)) && (value & BIT(eemwe)) && cyc - ee.mwe < 4U) {
+		if (spm.busy)
+			iss_fatal("EEPROM write while SPM is busy at %s\n", symbol_name(pc));
+		eeprom[a] = io[io_eedr];
+		ee.done   = now_ps + EEPROM_WRITE_PS;
+		return 2U;
+	}
+	if (value & BIT(eemwe))
+		ee.mwe = cyc;
+	return 0U;
+}
+
+static uint8_t ee_read_eecr(void)
+{
+	uint8_t v = io[io_eecr];
+
+	if (cyc - ee.mwe >= 4U)
+		v &= (uint8_t) ~BIT(eemwe);
+	if (now_ps < ee.done)
+		v |= BIT(eewe);
+	return v;
+}
+
+/* The pty and real time */
+
+static struct {
+	uint64_t next;
+	/* CLOCK_MONOTONIC time the simulation started at, moved on by stalls */
+	int64_t base_ns;
+} host;
+
+static int64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void host_pull(void)
+{
+	uint8_t buf[256];
+	size_t room;
+	ssize_t n, i;
+
+	for (;;) {
+		room = (usart.wtail + sizeof(usart.wire) - usart.whead - 1U) % sizeof(usart.wire);
+		if (!room)
+			break;
+		n = read(pty_fd, buf, (room < sizeof(buf)) ? room : sizeof(buf));
+		if (n <= 0)
+			break;
+		usart.host_bps = usart_host_bps();
+		for (i = 0; i < n; i++) {
+			if (usart.whead == usart.wtail)
+				usart.wire_end = ((usart.wire_end > now_ps) ? usart.wire_end : now_ps) +
+				                 usart_wire_ps();
+			usart.wire[usart.whead] = buf[i];
+			usart.whead = (usart.whead + 1U) % sizeof(usart.wire);
+		}
+	}
+}
+
+static void host_push(void)
+{
+	ssize_t n;
+
+	while (usart.otail != usart.ohead) {
+		unsigned int len;
+
+		len = (usart.ohead > usart.otail) ? usart.ohead - usart.otail
+		                                  : sizeof(usart.out) - usart.otail;
+		n = write(pty_fd, &usart.out[usart.otail], len);
+		if (n <= 0)
+			break;
+		usart.otail = (usart.otail + (unsigned int) n) % sizeof(usart.out);
+	}
+}
+
+/*
+	The last characters before an exit. The reader has a second for them,
+	and the queue must stay empty a while as the pty hands them over late.
+ */
+static void host_flush(void)
+{
+	int64_t until = mono_ns() + 1000000000LL;
+	unsigned int quiet = 0U;
+	int queued;
+
+	while (quiet < 10U && mono_ns() < until) {
+		host_push();
+		if (ioctl(pty_slave, FIONREAD, &queued) < 0)
+			queued = 0;
+		quiet = (usart.otail == usart.ohead && !queued) ? quiet + 1U : 0U;
+		usleep(1000);
+	}
+}
+
+static void report(void);
+
+static void host_sync(void)
+{
+	int64_t ahead;
+
+	ahead = (int64_t) (now_ps / 1000U) - (mono_ns() - host.base_ns);
+	if (ahead > AHEAD_NS) {
+		struct pollfd pfd = { .fd = pty_fd, .events = POLLIN };
+		struct timespec ts = { .tv_sec = ahead / 1000000000LL, .tv_nsec = ahead % 1000000000LL };
+
+		ppoll(&pfd, 1, &ts, NULL);
+	} else if (ahead < -LAG_NS) {
+		host.base_ns  += -ahead - LAG_NS;
+		prof.lost_ns  += (uint64_t) (-ahead - LAG_NS);
+	}
+	host_pull();
+	host_push();
+	host.next = now_ps + SYNC_PS;
+
+	if (got_report) {
+		got_report = 0;
+		report();
+	}
+	if (got_quit) {
+		host_flush();
+		report();
+		dump_files();
+		exit(0);
+	}
+}
+
+/* Interrupts and the times peripherals want a look */
+
+static void irq_update(void)
+{
+	if ((io[io_tifr] & BIT(tov1)) && (io[io_timsk] & BIT(toie1)))
+		pending = vec_t1_ovf;
+	else if ((io[io_tifr] & BIT(tov0)) && (io[io_timsk] & BIT(toie0)))
+		pending = vec_t0_ovf;
+	else if (usart.fifo_nr && (io[io_ucsrb] & BIT(rxcie)))
+		pending = vec_rxc;
+	else if (!usart.tx_full && (io[io_ucsrb] & BIT(udrie)))
+		pending = vec_udre;
+	else if ((io[io_ucsra] & BIT(txc)) && (io[io_ucsrb] & BIT(txcie)))
+		pending = vec_txc;
+	else if ((io[io_eecr] & BIT(eerie)) && now_ps >= ee.done)
+		pending = vec_ee_rdy;
+	else if ((io[io_tifr] & BIT(ocf0)) && (io[io_timsk] & BIT(ocie0)))
+		pending = vec_t0_comp;
+	else if ((io[io_spmcr] & BIT(spmie)) && !spm.busy && !spm_armed(4U))
+		pending = vec_spm_rdy;
+	else
+		pending = vec_none;
+}
+
+static void schedule_ps(uint64_t ps)
+{
+	uint64_t c = cyc + ((ps > now_ps) ? ps_to_cycles(ps - now_ps) : 1U);
+
+	if (c < next_cyc)
+		next_cyc = c;
+}
+
+static void schedule_cyc(uint64_t c)
+{
+	if (c <= cyc)
+		c = cyc + 1U;
+	if (c < next_cyc)
+		next_cyc = c;
+}
+
+static void schedule(void)
+{
+	unsigned int div;
+
+	next_cyc = UINT64_MAX;
+	schedule_ps(host.next);
+	if (usart.whead != usart.wtail)
+		schedule_ps(usart.wire_end);
+	if (usart.tx_busy)
+		schedule_cyc(usart.tx_done);
+	if (spm.busy)
+		schedule_ps(spm.done);
+	else if (spm.spmcr & BIT(spmen))
+		schedule_cyc(spm.written + 4U);
+	if (now_ps < ee.done)
+		schedule_ps(ee.done);
+
+	div = presc_div[io[io_tccr0] & 0x07U];
+	if (div && (io[io_timsk] & BIT(toie0)))
+		schedule_cyc(cyc + presc_cycles(div, 0x100U - io[io_tcnt0]));
+	if (div && (io[io_timsk] & BIT(ocie0)))
+		schedule_cyc(cyc + presc_cycles(div, t0_to_match(io[io_tcnt0])));
+	div = presc_div[io[io_tccr1b] & 0x07U];
+	if (div && (io[io_timsk] & BIT(toie1)))
+		schedule_cyc(cyc + presc_cycles(div, 0x10000U - tm.tcnt1));
+}
+
+static void sim_update(void)
+{
+	timers_update();
+	usart_update();
+	spm_update();
+	if (now_ps >= host.next)
+		host_sync();
+	irq_update();
+	schedule();
+}
+
+/* I/O space. Returned are the cycles CPU is halted for */
+
+static uint8_t io_read(uint8_t adr)
+{
+	uint8_t v;
+
+	sim_update();
+	switch (adr) {
+	case io_ucsra:
+		v = usart_ucsra();
+		break;
+	case io_udr:
+		v = usart_read_udr();
+		break;
+	case io_ubrrh:
+		v = (uint8_t) (usart.ubrr >> 8);
+		break;
+	case io_pind:
+		v = (uint8_t) ((io[io_pind] & 0xfeU) | usart_rxd());
+		break;
+	case io_tcnt1l:
+		/* The high byte is latched for the following read */
+		tm.temp = (uint8_t) (tm.tcnt1 >> 8);
+		v = (uint8_t) tm.tcnt1;
+		break;
+	case io_tcnt1h:
+		v = tm.temp;
+		break;
+	case io_eecr:
+		v = ee_read_eecr();
+		break;
+	case io_spmcr:
+		v = spm_read_spmcr();
+		break;
+	default:
+		v = io[adr];
+		break;
+	}
+	irq_update();
+	return v;
+}
+
+static unsigned int io_write(uint8_t adr, uint8_t value)
+{
+	unsigned int halt = 0U;
+
+	sim_update();
+	switch (adr) {
+	case io_ucsra:
+		io[io_ucsra] = (io[io_ucsra] & (uint8_t) ~(BIT(u2x) | BIT(mpcm)))
+		             | (value & (BIT(u2x) | BIT(mpcm)));
+		if (value & BIT(txc))
+			io[io_ucsra] &= (uint8_t) ~BIT(txc);
+		break;
+	case io_ubrrh:
+		if (value & BIT(ursel))
+			usart.ucsrc = value;
+		else
+			usart.ubrr = (uint16_t) ((usart.ubrr & 0x00ffU) | ((uint16_t) (value & 0x0fU) << 8));
+		break;
+	case io_ubrrl:
+		usart.ubrr = (uint16_t) ((usart.ubrr & 0x0f00U) | value);
+		break;
+	case io_udr:
+		usart_write_udr(value);
+		break;
+	case io_ucsrb:
+		/* Disabling the receiver flushes the FIFO */
+		if (!(value & BIT(rxen)))
+			usart.fifo_nr = 0U;
+		io[io_ucsrb] = value;
+		break;
+	case io_tifr:
+		io[io_tifr] &= (uint8_t) ~value;
+		break;
+	case io_tcnt1h:
+		tm.temp = value;
+		break;
+	case io_tcnt1l:
+		tm.tcnt1 = (uint16_t) (((uint16_t) tm.temp << 8) | value);
+		break;
+	case io_sfior:
+		if (value & BIT(PSR10))
+			tm.presc = 0U;
+		io[io_sfior] = value & (uint8_t) ~BIT(PSR10);
+		break;
+	case io_osccal:
+		io[io_osccal] = value;
+		set_clock((cpu_nominal * (uint64_t) (1000000 + CAL_STEP_PPM * ((int) value - cal_ideal)))
+		          / 1000000ULL);
+		break;
+	case io_eecr:
+		halt = ee_write_eecr(value);
+		break;
+	case io_spmcr:
+		io[io_spmcr] = value & BIT(spmie);
+		if (!spm.busy) {
+			spm.spmcr   = value & (uint8_t) ~BIT(spmie);
+			spm.written = cyc;
+		}
+		break;
+	case io_gicr:
+		/* IVSEL changes within four cycles of IVCE, interrupts are off meanwhile */
+		if (value & BIT(ivce)) {
+			ivce_until = cyc + 4U;
+		} else if (cyc < ivce_until) {
+			io[io_gicr] = (io[io_gicr] & (uint8_t) ~BIT(ivsel)) | (value & BIT(ivsel));
+			ivce_until  = 0U;
+		}
+		io[io_gicr] = (io[io_gicr] & BIT(ivsel)) | (value & (uint8_t) ~(BIT(ivsel) | BIT(ivce)));
+		break;
+	default:
+		io[adr] = value;
+		break;
+	}
+	irq_update();
+	schedule();
+	return halt;
+}
+
+/* Data space: registers, I/O and SRAM */
+
+static uint8_t data_read(uint16_t a)
+{
+	if (a < 0x20U)
+		return reg[a];
+	if (a < RAM_START)
+		return io_read((uint8_t) (a - 0x20U));
+	if (a >= RAM_END)
+		iss_fatal("read beyond RAM: %#x at %s\n", a, symbol_name(pc));
+	return sram[a - RAM_START];
+}
+
+static unsigned int data_write(uint16_t a, uint8_t v)
+{
+	if (a < 0x20U) {
+		reg[a] = v;
+		return 0U;
+	}
+	if (a < RAM_START)
+		return io_write((uint8_t) (a - 0x20U), v);
+	if (a >= RAM_END)
+		iss_fatal("write beyond RAM: %#x at %s\n", a, symbol_name(pc));
+	sram[a - RAM_START] = v;
+	return 0U;
+}
+
+static uint16_t sp_get(void)
+{
+	return (uint16_t) (io[io_spl] | io[io_sph] << 8);
+}
+
+static void sp_set(uint16_t sp)
+{
+	io[io_spl] = (uint8_t) sp;
+	io[io_sph] = (uint8_t) (sp >> 8);
+}
+
+static void push(uint8_t v)
+{
+	uint16_t sp = sp_get();
+
+	if (sp < RAM_START)
+		iss_fatal("stack overflow at %s\n", symbol_name(pc));
+	sram[sp - RAM_START] = v;
+	sp_set(sp - 1U);
+}
+
+static uint8_t pop(void)
+{
+	uint16_t sp = sp_get() + 1U;
+
+	if (sp >= RAM_END)
+		iss_fatal("stack underflow at %s\n", symbol_name(pc));
+	sp_set(sp);
+	return sram[sp - RAM_START];
+}
+
+/* Return address goes low byte first, so it is big endian in memory */
+static void push_pc(uint16_t addr)
+{
+	push((uint8_t) addr);
+	push((uint8_t) (addr >> 8));
+}
+
+static uint16_t pop_pc(void)
+{
+	uint16_t addr = (uint16_t) pop() << 8;
+
+	return (addr | pop()) & PC_MASK;
+}
+
+/* Instructions */
+
+static uint16_t fetch(uint16_t at)
+{
+	at &= PC_MASK;
+	return (uint16_t) (flash[2U * at] | flash[2U * at + 1U] << 8);
+}
+
+/* LDS, STS, JMP and CALL take two words */
+static int two_words(uint16_t w)
+{
+	return (w & 0xfc0fU) == 0x9000U || (w & 0xfe0cU) == 0x940cU;
+}
+
+static uint16_t ptr(unsigned int r)
+{
+	return (uint16_t) (reg[r] | reg[r + 1U] << 8);
+}
+
+static void ptr_set(unsigned int r, uint16_t v)
+{
+	reg[r]      = (uint8_t) v;
+	reg[r + 1U] = (uint8_t) (v >> 8);
+}
+
+static void flags(uint8_t mask, uint8_t set)
+{
+	uint8_t f = (io[io_sreg] & (uint8_t) ~mask) | set;
+
+	/* S is N ^ V */
+	if (mask & BIT(bit_s))
+		f = (f & (uint8_t) ~BIT(bit_s)) | (uint8_t) ((((f >> bit_n) ^ (f >> bit_v)) & 1U) << bit_s);
+	io[io_sreg] = f;
+}
+
+#define HCVNZS    (BIT(bit_h) | BIT(bit_c) | BIT(bit_v) | BIT(bit_n) | BIT(bit_z) | BIT(bit_s))
+#define VNZS      (BIT(bit_v) | BIT(bit_n) | BIT(bit_z) | BIT(bit_s))
+#define CVNZS     (BIT(bit_c) | VNZS)
+
+static uint8_t nz(uint8_t res)
+{
+	return (uint8_t) ((res & 0x80U) ? BIT(bit_n) : 0U) | (uint8_t) (res ? 0U : BIT(bit_z));
+}
+
+static uint8_t do_add(uint8_t d, uint8_t r, int carry)
+{
+	uint8_t res = (uint8_t) (d + r + (carry ? (io[io_sreg] & 1U) : 0U));
+	uint8_t c = (d & r) | (r & ~res) | (~res & d);
+	uint8_t v = ((d & r & ~res) | (~d & ~r & res)) & 0x80U;
+
+	flags(HCVNZS, nz(res) | ((c & 0x80U) ? BIT(bit_c) : 0U) | ((c & 0x08U) ? BIT(bit_h) : 0U) |
+	              (v ? BIT(bit_v) : 0U));
+	return res;
+}
+
+/* SBC, SBCI and CPC leave Z clear unless it is set already */
+static uint8_t do_sub(uint8_t d, uint8_t r, int carry)
+{
+	uint8_t res = (uint8_t) (d - r - (carry ? (io[io_sreg] & 1U) : 0U));
+	uint8_t b = (~d & r) | (r & res) | (res & ~d);
+	uint8_t v = ((d & ~r & ~res) | (~d & r & res)) & 0x80U;
+	uint8_t f = nz(res);
+
+	if (carry && !(io[io_sreg] & BIT(bit_z)))
+		f &= (uint8_t) ~BIT(bit_z);
+	flags(HCVNZS, f | ((b & 0x80U) ? BIT(bit_c) : 0U) | ((b & 0x08U) ? BIT(bit_h) : 0U) |
+	              (v ? BIT(bit_v) : 0U));
+	return res;
+}
+
+static uint8_t do_logic(uint8_t res)
+{
+	flags(VNZS, nz(res));
+	return res;
+}
+
+static uint8_t do_shift(uint8_t d, uint8_t res)
+{
+	uint8_t f = nz(res) | (uint8_t) ((d & 1U) ? BIT(bit_c) : 0U);
+
+	/* V is N ^ C */
+	if (((f >> bit_n) ^ f) & 1U)
+		f |= BIT(bit_v);
+	flags(CVNZS, f);
+	return res;
+}
+
+static void do_mul(int32_t product, int fractional)
+{
+	uint16_t p = (uint16_t) product;
+	uint8_t f = (p & 0x8000U) ? BIT(bit_c) : 0U;
+
+	if (fractional)
+		p = (uint16_t) (p << 1);
+	if (!p)
+		f |= BIT(bit_z);
+	reg[0] = (uint8_t) p;
+	reg[1] = (uint8_t) (p >> 8);
+	flags(BIT(bit_c) | BIT(bit_z), f);
+}
+
+/* Skips the next instruction if @cond, returns the cycles it takes */
+static unsigned int skip(int cond)
+{
+	if (!cond)
+		return 1U;
+	if (two_words(fetch(pc))) {
+		pc = (pc + 2U) & PC_MASK;
+		return 3U;
+	}
+	pc = (pc + 1U) & PC_MASK;
+	return 2U;
+}
+
+static void illegal(uint16_t at, uint16_t w) __attribute__((noreturn));
+static void illegal(uint16_t at, uint16_t w)
+{
+	iss_fatal("illegal opcode %04x at %s\n", w, symbol_name(at));
+}
+
+static void tick(uint16_t at, unsigned int n)
+{
+	prof.cycles[at] += n;
+	prof.hits[at]++;
+	cyc    += n;
+	now_ps += n * cycle_ps;
+}
+
+static void halted(uint16_t at)
+{
+	/* The transmitter still sends what it has */
+	usart_update();
+	while (usart.tx_busy) {
+		tick(at, (unsigned int) (usart.tx_done - cyc));
+		usart_update();
+	}
+	host_flush();
+	fprintf(stderr, "ISS: firmware halted at %s\n", symbol_name(at));
+	report();
+	dump_files();
+	exit(3);
+}
+
+/* Executes the instruction at pc and returns the cycles it takes */
+static unsigned int step(void)
+{
+	uint16_t at = pc, w = fetch(pc), a, k;
+	unsigned int d = (w >> 4) & 0x1fU, r = (w & 0x0fU) | ((w >> 5) & 0x10U), n = 1U;
+	unsigned int dh = 16U + ((w >> 4) & 0x0fU);
+	uint8_t imm = (uint8_t) ((w & 0x0fU) | ((w >> 4) & 0xf0U));
+	int32_t off;
+
+	pc = (pc + 1U) & PC_MASK;
+	switch (w >> 12) {
+	case 0x0:
+		switch ((w >> 10) & 3U) {
+		case 0:
+			if (w == 0x0000U) {
+				/* NOP */
+			} else if ((w & 0xff00U) == 0x0100U) {
+				/* MOVW */
+				reg[2U * ((w >> 4) & 0x0fU)]      = reg[2U * (w & 0x0fU)];
+				reg[2U * ((w >> 4) & 0x0fU) + 1U] = reg[2U * (w & 0x0fU) + 1U];
+			} else if ((w & 0xff00U) == 0x0200U) {
+				/* MULS */
+				do_mul((int8_t) reg[dh] * (int8_t) reg[16U + (w & 0x0fU)], 0);
+				n = 2U;
+			} else {
+				uint8_t rd = reg[16U + ((w >> 4) & 0x07U)], rr = reg[16U + (w & 0x07U)];
+
+				switch (w & 0x0088U) {
+				case 0x0000U:
+					/* MULSU */
+					do_mul((int8_t) rd * rr, 0);
+					break;
+				case 0x0008U:
+					/* FMUL */
+					do_mul(rd * rr, 1);
+					break;
+				case 0x0080U:
+					/* FMULS */
+					do_mul((int8_t) rd * (int8_t) rr, 1);
+					break;
+				default:
+					/* FMULSU */
+					do_mul((int8_t) rd * rr, 1);
+					break;
+				}
+				n = 2U;
+			}
+			break;
+		case 1:
+			/* CPC */
+			do_sub(reg[d], reg[r], 1);
+			break;
+		case 2:
+			/* SBC */
+			reg[d] = do_sub(reg[d], reg[r], 1);
+			break;
+		default:
+			/* ADD */
+			reg[d] = do_add(reg[d], reg[r], 0);
+			break;
+		}
+		break;
+	case 0x1:
+		switch ((w >> 10) & 3U) {
+		case 0:
+			/* CPSE */
+			n = skip(reg[d] == reg[r]);
+			break;
+		case 1:
+			/* CP */
+			do_sub(reg[d], reg[r], 0);
+			break;
+		case 2:
+			/* SUB */
+			reg[d] = do_sub(reg[d], reg[r], 0);
+			break;
+		default:
+			/* ADC */
+			reg[d] = do_add(reg[d], reg[r], 1);
+			break;
+		}
+		break;
+	case 0x2:
+		switch ((w >> 10) & 3U) {
+		case 0:
+			reg[d] = do_logic(reg[d] & reg[r]);
+			break;
+		case 1:
+			reg[d] = do_logic(reg[d] ^ reg[r]);
+			break;
+		case 2:
+			reg[d] = do_logic(reg[d] | reg[r]);
+			break;
+		default:
+			/* MOV */
+			reg[d] = reg[r];
+			break;
+		}
+		break;
+	case 0x3:
+		/* CPI */
+		do_sub(reg[dh], imm, 0);
+		break;
+	case 0x4:
+		/* SBCI */
+		reg[dh] = do_sub(reg[dh], imm, 1);
+		break;
+	case 0x5:
+		/* SUBI */
+		reg[dh] = do_sub(reg[dh], imm, 0);
+		break;
+	case 0x6:
+		/* ORI */
+		reg[dh] = do_logic(reg[dh] | imm);
+		break;
+	case 0x7:
+		/* ANDI */
+		reg[dh] = do_logic(reg[dh] & imm);
+		break;
+	case 0x8:
+	case 0xa:
+		/* LDD and STD, LD and ST with Y or Z without displacement */
+		a = ptr((w & 0x0008U) ? 28U : 30U) +
+		    ((w & 0x07U) | ((w >> 7) & 0x18U) | ((w >> 8) & 0x20U));
+		n = 2U;
+		if (w & 0x0200U)
+			n += data_write(a, reg[d]);
+		else
+			reg[d] = data_read(a);
+		break;
+	case 0x9:
+		switch ((w >> 9) & 7U) {
+		case 0:
+		case 1:
+			/* Loads and stores with X, Y, Z and pointer updates, LDS, STS, LPM, PUSH, POP */
+			{
+				int store = (w & 0x0200U) != 0;
+				unsigned int p;
+
+				switch (w & 0x0fU) {
+				case 0x0:
+					k  = fetch(pc);
+					pc = (pc + 1U) & PC_MASK;
+					n  = 2U;
+					if (store)
+						n += data_write(k, reg[d]);
+					else
+						reg[d] = data_read(k);
+					goto out;
+				case 0x4:
+				case 0x5:
+					if (store)
+						illegal(at, w);
+					/* LPM Rd,Z and LPM Rd,Z+ */
+					reg[d] = spm_lpm(ptr(30U));
+					if (w & 0x01U)
+						ptr_set(30U, ptr(30U) + 1U);
+					n = 3U;
+					goto out;
+				case 0xf:
+					if (store)
+						push(reg[d]);
+					else
+						reg[d] = pop();
+					n = 2U;
+					goto out;
+				case 0x1:
+				case 0x2:
+					p = 30U;
+					break;
+				case 0x9:
+				case 0xa:
+					p = 28U;
+					break;
+				case 0xc:
+				case 0xd:
+				case 0xe:
+					p = 26U;
+					break;
+				default:
+					illegal(at, w);
+				}
+				a = ptr(p);
+				/* Predecrement */
+				if ((w & 0x03U) == 0x02U)
+					ptr_set(p, --a);
+				n = 2U;
+				if (store)
+					n += data_write(a, reg[d]);
+				else
+					reg[d] = data_read(a);
+				/* Postincrement */
+				if ((w & 0x03U) == 0x01U)
+					ptr_set(p, a + 1U);
+			}
+			break;
+		case 2:
+			switch (w & 0x0fU) {
+			case 0x0:
+				reg[d] = do_logic((uint8_t) ~reg[d]);
+				flags(BIT(bit_c), BIT(bit_c));
+				break;
+			case 0x1:
+				/* NEG */
+				reg[d] = do_sub(0U, reg[d], 0);
+				break;
+			case 0x2:
+				reg[d] = (uint8_t) (reg[d] << 4 | reg[d] >> 4);
+				break;
+			case 0x3:
+				/* INC */
+				reg[d]++;
+				flags(VNZS, nz(reg[d]) | ((reg[d] == 0x80U) ? BIT(bit_v) : 0U));
+				break;
+			case 0x5:
+				/* ASR */
+				reg[d] = do_shift(reg[d], (uint8_t) ((reg[d] >> 1) | (reg[d] & 0x80U)));
+				break;
+			case 0x6:
+				/* LSR */
+				reg[d] = do_shift(reg[d], (uint8_t) (reg[d] >> 1));
+				break;
+			case 0x7:
+				/* ROR */
+				reg[d] = do_shift(reg[d], (uint8_t) ((reg[d] >> 1) | ((io[io_sreg] & 1U) << 7)));
+				break;
+			case 0xa:
+				/* DEC */
+				reg[d]--;
+				flags(VNZS, nz(reg[d]) | ((reg[d] == 0x7fU) ? BIT(bit_v) : 0U));
+				break;
+			case 0x8:
+				if (!(w & 0x0100U)) {
+					/* BSET and BCLR, SEI and CLI among them */
+					uint8_t bit = BIT((w >> 4) & 0x07U);
+
+					if (w & 0x0080U) {
+						io[io_sreg] &= (uint8_t) ~bit;
+					} else {
+						if (bit == BIT(bit_i) && !(io[io_sreg] & bit))
+							irq_hold = 1;
+						io[io_sreg] |= bit;
+					}
+					break;
+				}
+				switch ((w >> 4) & 0x0fU) {
+				case 0x0:
+					/* RET */
+					pc = pop_pc();
+					n  = 4U;
+					break;
+				case 0x1:
+					/* RETI */
+					pc = pop_pc();
+					io[io_sreg] |= BIT(bit_i);
+					irq_hold = 1;
+					n = 4U;
+					break;
+				case 0x8:
+					if (io[io_mcucr] & BIT(SE))
+						sleeping = 1;
+					break;
+				case 0x9:
+				case 0xa:
+					/* BREAK and WDR, the watchdog is not modelled */
+					break;
+				case 0xc:
+					/* LPM */
+					reg[0] = spm_lpm(ptr(30U));
+					n = 3U;
+					break;
+				case 0xe:
+					/* The manual gives no cycle count for SPM, taken as for LPM */
+					spm_exec();
+					n = 3U;
+					break;
+				default:
+					illegal(at, w);
+				}
+				break;
+			case 0x9:
+				if ((w & 0xfeffU) != 0x9409U)
+					illegal(at, w);
+				/* IJMP and ICALL */
+				if (w & 0x0100U) {
+					push_pc(pc);
+					n = 3U;
+				} else {
+					n = 2U;
+				}
+				pc = ptr(30U) & PC_MASK;
+				break;
+			case 0xc:
+			case 0xd:
+			case 0xe:
+			case 0xf:
+				/* JMP and CALL */
+				k = fetch(pc);
+				pc = (pc + 1U) & PC_MASK;
+				if (w & 0x02U) {
+					push_pc(pc);
+					n = 4U;
+				} else {
+					n = 3U;
+				}
+				pc = k & PC_MASK;
+				break;
+			default:
+				illegal(at, w);
+			}
+			break;
+		case 3:
+			/* ADIW and SBIW */
+			{
+				unsigned int p = 24U + ((w >> 3) & 0x06U);
+				uint16_t v = ptr(p), res, kk = (uint16_t) ((w & 0x0fU) | ((w >> 2) & 0x30U));
+				uint8_t f;
+
+				if (w & 0x0100U) {
+					res = v - kk;
+					f   = ((v & ~res) & 0x8000U) ? BIT(bit_v) : 0U;
+					f  |= ((res & ~v) & 0x8000U) ? BIT(bit_c) : 0U;
+				} else {
+					res = v + kk;
+					f   = ((res & ~v) & 0x8000U) ? BIT(bit_v) : 0U;
+					f  |= ((v & ~res) & 0x8000U) ? BIT(bit_c) : 0U;
+				}
+				f |= (res & 0x8000U) ? BIT(bit_n) : 0U;
+				f |= res ? 0U : BIT(bit_z);
+				flags(CVNZS, f);
+				ptr_set(p, res);
+				n = 2U;
+			}
+			break;
+		case 4:
+		case 5:
+			/* CBI, SBIC, SBI, SBIS */
+			{
+				uint8_t adr = (uint8_t) ((w >> 3) & 0x1fU), bit = BIT(w & 0x07U), v;
+
+				v = io_read(adr);
+				switch ((w >> 8) & 3U) {
+				case 0:
+					n = 2U + io_write(adr, v & (uint8_t) ~bit);
+					break;
+				case 1:
+					n = skip(!(v & bit));
+					break;
+				case 2:
+					n = 2U + io_write(adr, v | bit);
+					break;
+				default:
+					n = skip(v & bit);
+					break;
+				}
+			}
+			break;
+		default:
+			/* MUL */
+			do_mul(reg[d] * reg[r], 0);
+			n = 2U;
+			break;
+		}
+		break;
+	case 0xb:
+		/* IN and OUT */
+		a = (w & 0x0fU) | ((w >> 5) & 0x30U);
+		if (w & 0x0800U) {
+			n += io_write((uint8_t) a, reg[d]);
+		} else {
+			reg[d] = io_read((uint8_t) a);
+		}
+		break;
+	case 0xc:
+		/* RJMP. A jump to itself with interrupts off is the end, see die() */
+		off = (int16_t) (w << 4) >> 4;
+		if (off == -1 && !(io[io_sreg] & BIT(bit_i)))
+			halted(at);
+		pc = (uint16_t) (pc + off) & PC_MASK;
+		n  = 2U;
+		break;
+	case 0xd:
+		/* RCALL */
+		off = (int16_t) (w << 4) >> 4;
+		push_pc(pc);
+		pc = (uint16_t) (pc + off) & PC_MASK;
+		n  = 3U;
+		break;
+	case 0xe:
+		/* LDI */
+		reg[dh] = imm;
+		break;
+	default:
+		if (!(w & 0x0800U)) {
+			/* BRBS and BRBC */
+			int set = (io[io_sreg] >> (w & 0x07U)) & 1U;
+
+			if (set == !(w & 0x0400U)) {
+				off = (w >> 3) & 0x7fU;
+				if (off & 0x40)
+					off -= 0x80;
+				pc = (uint16_t) (pc + off) & PC_MASK;
+				n  = 2U;
+			}
+		} else if (w == 0xffffU) {
+			/* Erased flash, the chip slides through it as through NOPs */
+		} else if (w & 0x0008U) {
+			illegal(at, w);
+		} else if (!(w & 0x0400U)) {
+			if (w & 0x0200U)
+				/* BST */
+				flags(BIT(bit_t), ((reg[d] >> (w & 0x07U)) & 1U) ? BIT(bit_t) : 0U);
+			else if (io[io_sreg] & BIT(bit_t))
+				/* BLD */
+				reg[d] |= BIT(w & 0x07U);
+			else
+				reg[d] &= (uint8_t) ~BIT(w & 0x07U);
+		} else {
+			/* SBRC and SBRS */
+			int set = (reg[d] >> (w & 0x07U)) & 1U;
+
+			n = skip((w & 0x0200U) ? set : !set);
+		}
+		break;
+	}
+out:
+	return n;
+}
+
+static void irq_off_begin(uint16_t at)
+{
+	irq_off_since = cyc;
+	irq_off_pc    = at;
+}
+
+static void irq_off_end(void)
+{
+	uint64_t len = cyc - irq_off_since;
+
+	if (len > prof.irq_off[irq_off_pc])
+		prof.irq_off[irq_off_pc] = (uint32_t) ((len > UINT32_MAX) ? UINT32_MAX : len);
+}
+
+static void irq_enter(void)
+{
+	uint16_t base = (io[io_gicr] & BIT(ivsel)) ? boot_start : 0U, at = base + pending;
+
+	/* Flags cleared by hardware on vector execution */
+	switch (pending) {
+	case vec_t1_ovf:
+		io[io_tifr] &= (uint8_t) ~BIT(tov1);
+		break;
+	case vec_t0_ovf:
+		io[io_tifr] &= (uint8_t) ~BIT(tov0);
+		break;
+	case vec_t0_comp:
+		io[io_tifr] &= (uint8_t) ~BIT(ocf0);
+		break;
+	case vec_txc:
+		io[io_ucsra] &= (uint8_t) ~BIT(txc);
+		break;
+	default:
+		break;
+	}
+	push_pc(pc);
+	io[io_sreg] &= (uint8_t) ~BIT(bit_i);
+	irq_off_begin(at);
+	pc = at;
+	/* Four cycles of response, four more to wake up from sleep */
+	tick(at, sleeping ? 8U : 4U);
+	sleeping = 0;
+	irq_update();
+}
+
+static void run(void)
+{
+	uint8_t i_before;
+	uint16_t at;
+
+	for (;;) {
+		if (cyc >= next_cyc)
+			sim_update();
+		if (pending && (io[io_sreg] & BIT(bit_i)) && !irq_hold && cyc >= ivce_until)
+			irq_enter();
+		if (sleeping) {
+			/* Nothing happens until the peripherals want a look */
+			tick(pc, (unsigned int) (next_cyc - cyc));
+			continue;
+		}
+		if (pc < boot_start && spm.rwwsb)
+			iss_fatal("executes busy RWW section at %s\n", symbol_name(pc));
+		irq_hold = 0;
+		at       = pc;
+		i_before = io[io_sreg] & BIT(bit_i);
+		tick(at, step());
+		if (i_before != (io[io_sreg] & BIT(bit_i))) {
+			if (i_before)
+				irq_off_begin(at);
+			else
+				irq_off_end();
+		}
+	}
+}
+
+/* Report of the cycles, see the top of the file */
+
+struct entry {
+	uint16_t addr;
+	uint64_t cycles, calls, value;
+};
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct entry *x = a, *y = b;
+
+	return (x->value < y->value) - (x->value > y->value);
+}
+
+#define REPORT_PCS          20U
+#define REPORT_IRQ_OFF      5U
+
+static void report(void)
+{
+	static struct entry entries[FLASH_SIZE / 2U];
+	uint64_t total = cyc - prof.start_cyc;
+	unsigned int i, j, nr = 0;
+
+	fprintf(stderr, "CYCLES %llu in %.6f s of the device, clock %llu Hz\n",
+	        (unsigned long long) total, (double) (now_ps - prof.start_ps) / 1e12,
+	        (unsigned long long) cpu_hz);
+	fprintf(stderr, "USART %lu characters in, %lu out, %lu overruns, %lu frame errors\n",
+	        prof.rx, prof.tx, prof.overruns, prof.frame_errors);
+	if (prof.lost_ns)
+		fprintf(stderr, "HOST stalled the simulation for %llu us\n",
+		        (unsigned long long) (prof.lost_ns / 1000U));
+	if (prof.rww_reads)
+		fprintf(stderr, "LPM %lu reads from busy RWW section\n", prof.rww_reads);
+
+	/* Longest windows with interrupts off */
+	if (!(io[io_sreg] & BIT(bit_i)))
+		irq_off_end();
+	for (i = 0; i < FLASH_SIZE / 2U; i++)
+		if (prof.irq_off[i])
+			entries[nr++] = (struct entry) { .addr = i, .value = prof.irq_off[i] };
+	qsort(entries, nr, sizeof(entries[0]), entry_cmp);
+	for (i = 0; i < nr && i < REPORT_IRQ_OFF; i++)
+		fprintf(stderr, "IRQ OFF %llu cycles from %s\n",
+		        (unsigned long long) entries[i].value, symbol_name(entries[i].addr));
+
+	/* Cycles by function, or by instruction without symbols */
+	nr = 0;
+	if (symbols_nr) {
+		for (i = 0; i < symbols_nr; i++) {
+			uint16_t end = (i + 1U < symbols_nr) ? symbols[i + 1U].addr : FLASH_SIZE / 2U;
+			struct entry *e = &entries[nr];
+
+			*e = (struct entry) { .addr = symbols[i].addr, .calls = prof.hits[symbols[i].addr] };
+			for (j = symbols[i].addr; j < end; j++)
+				e->cycles += prof.cycles[j];
+			e->value = e->cycles;
+			if (e->cycles)
+				nr++;
+		}
+	} else {
+		for (i = 0; i < FLASH_SIZE / 2U; i++)
+			if (prof.cycles[i])
+				entries[nr++] = (struct entry) { .addr = i, .cycles = prof.cycles[i],
+				                                 .calls = prof.hits[i], .value = prof.cycles[i] };
+	}
+	qsort(entries, nr, sizeof(entries[0]), entry_cmp);
+	if (!symbols_nr && nr > REPORT_PCS)
+		nr = REPORT_PCS;
+	fprintf(stderr, "%14s %6s %10s %10s  %s\n", "CYCLES", "%", symbols_nr ? "CALLS" : "RUNS",
+	        "CYC/CALL", symbols_nr ? "FUNCTION" : "ADDRESS");
+	for (i = 0; i < nr; i++)
+		fprintf(stderr, "%14llu %6.2f %10llu %10.1f  %s\n",
+		        (unsigned long long) entries[i].cycles,
+		        total ? 100.0 * (double) entries[i].cycles / (double) total : 0.0,
+		        (unsigned long long) entries[i].calls,
+		        entries[i].calls ? (double) entries[i].cycles / (double) entries[i].calls : 0.0,
+		        symbol_name(entries[i].addr));
+
+	memset(&prof, 0, sizeof(prof));
+	prof.start_cyc = cyc;
+	prof.start_ps  = now_ps;
+	irq_off_since  = cyc;
+}
+
+static void on_quit(int sig)
+{
+	(void) sig;
+	got_quit = 1;
+}
+
+static void on_report(int sig)
+{
+	(void) sig;
+	got_report = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	        "USAGE: %s [-l <low fuse>] [-H <high fuse>] [-f <flash image>] [-o <flash dump>]\n"
+	        "       [-p <pty link>] [-e <rx error ppm>] [-E <tx error ppm>]\n"
+	        "       [-C <OSCCAL of nominal clock>] [-r <EEPROM image>] [-s <ELF file>]\n"
+	        "       <ihex file>\n",
+	        prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *link_path = NULL, *img_path = NULL, *elf_path = NULL;
+	static const uint16_t boot_sizes[4] = { 1024U, 512U, 256U, 128U };
+	struct sigaction sa;
+	struct termios tios;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "l:H:f:o:p:e:E:C:r:s:")) != -1) {
+		switch (opt) {
+		case 'l':
+			fuses.low = (uint8_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			fuses.high = (uint8_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			img_path = optarg;
+			break;
+		case 'o':
+			dump_path = optarg;
+			break;
+		case 'p':
+			link_path = optarg;
+			break;
+		case 'e':
+			err_ppm = (unsigned int) strtoul(optarg, NULL, 0);
+			break;
+		case 'E':
+			tx_err_ppm = (unsigned int) strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			cal_ideal = (int) strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			eeprom_path = optarg;
+			break;
+		case 's':
+			elf_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+
+	switch (fuses.low & 0x0fU) {
+	case 0x01U: cpu_nominal = 1000000ULL; break;
+	case 0x02U: cpu_nominal = 2000000ULL; break;
+	case 0x03U: cpu_nominal = 4000000ULL; break;
+	default:    cpu_nominal = 8000000ULL; break;
+	}
+	set_clock(cpu_nominal);
+	/* Default: the chip matches the table of the firmware */
+	if (cal_ideal < 0)
+		cal_ideal = (cpu_nominal <= 2000000ULL) ? 0xa9 : 0xa7;
+	io[io_osccal] = (uint8_t) cal_ideal;
+	boot_start = FLASH_SIZE / 2U - boot_sizes[(fuses.high >> 1) & 0x03U];
+
+	memset(flash, 0xff, sizeof(flash));
+	if (img_path) {
+		FILE *f = fopen(img_path, "rb");
+
+		if (!f)
+			iss_fatal("can't open %s\n", img_path);
+		if (fread(flash, 1, (size_t) boot_start * 2U, f) == 0 && ferror(f))
+			iss_fatal("can't read %s\n", img_path);
+		fclose(f);
+	}
+	load_ihex(argv[optind]);
+	if (elf_path)
+		load_symbols(elf_path);
+
+	memset(eeprom, 0xff, sizeof(eeprom));
+	if (eeprom_path) {
+		FILE *f = fopen(eeprom_path, "rb");
+
+		if (f) {
+			if (fread(eeprom, 1, sizeof(eeprom), f) == 0 && ferror(f))
+				iss_fatal("can't read %s\n", eeprom_path);
+			fclose(f);
+		}
+	}
+	memset(spm.buf, 0xff, sizeof(spm.buf));
+	io[io_ucsra] = BIT(udre);
+	usart.ucsrc  = BIT(ursel) | BIT(ucsz1) | BIT(ucsz0);
+
+	pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (pty_fd < 0 || grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0)
+		iss_fatal("pty: %s\n", strerror(errno));
+	pty_slave = open(ptsname(pty_fd), O_RDWR | O_NOCTTY);
+	if (pty_slave < 0 || tcgetattr(pty_slave, &tios) < 0)
+		iss_fatal("pty slave: %s\n", strerror(errno));
+	cfmakeraw(&tios);
+	tcsetattr(pty_slave, TCSANOW, &tios);
+	fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL) | O_NONBLOCK);
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(ptsname(pty_fd), link_path) < 0)
+			iss_fatal("symlink: %s\n", strerror(errno));
+	}
+	printf("%s\n", ptsname(pty_fd));
+	fflush(stdout);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_quit;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sa.sa_handler = on_report;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	/* Reset: BOOTRST sends it to the bootloader, interrupts are off */
+	pc = (fuses.high & 0x01U) ? 0U : boot_start;
+	irq_off_begin(pc);
+	host.base_ns = mono_ns();
+	run();
+	return 0;
+}
@@ -0,0 +1,1625 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <ucontext.h>
+#include <elf.h>
+
+#include "avr-upload.h"
+
+/* Largest packet buffer of the device we are able to use */
+#define USART_BUFSZ_MAX    0x1000U
+/* ELF address of AVR RAM. EEPROM lies above it too */
+#define ELF_AVR_RAM        0x800000U
+
+/*
+	Time the device may spend on a packet besides transmitting it:
+	checksumming, waiting for up to two flash pages and the answer itself.
+	Retransmission timeout starts from line time of the packet plus this slack
+	and is doubled upon each consecutive timeout.
+ */
+#define ANSWER_SLACK_MS    50U
+#define ANSWER_TMO_MAX_MS  2000U
+#define MAX_RETRIES        8U
+/* Upper bound of packets in flight, whatever credit the device grants */
+#define MAX_INFLIGHT       16U
+/* Time the device may spend on erasing and writing a page of PACKET_FILL */
+#define PAGE_WRITE_MS      10U
+/* Time the device may spend on hashing PACKET_HASH_PAGES pages */
+#define HASH_SLACK_MS      500U
+/* Time RXD is low during the sync the device times per OSCCAL step */
+#define CAL_LOW_US         4000U
+/* Time the device may spend on EEPROM and the idle line after the sync */
+#define CAL_SLACK_MS       250U
+/* Shortest packet on the line the transfer shrinks to on a noisy line */
+#define PKTSZ_MIN          32U
+/* Packets which pass in a row before the line is tried faster */
+#define CLEAN_PACKETS      32U
+/* Failures of the shortest packets the rate is judged by */
+#define NOISY_FAILURES     4U
+
+/*
+	Rates the sync is sent at, fastest first. The device locks on
+	the first one its clock produces. See `base/usart.c:usart_autobaud()`.
+ */
+static const struct {
+	speed_t speed;
+	unsigned int baud;
+} avr_rates[] = {
+	{ B1000000, 1000000 },
+	{ B500000,  500000  },
+	{ B230400,  230400  },
+	{ B115200,  115200  },
+	{ B57600,   57600   },
+	{ B38400,   38400   },
+	{ B19200,   19200   },
+	{ B9600,    9600    },
+};
+
+/*
+	The device measures the rate of a run of SYNC_NR characters SYNC_CHAR
+	and answers ANSWER_NACK once it runs at that rate.
+ */
+#define SYNC_CHAR    0x80U
+#define SYNC_NR      16U
+
+/* Header of the UART packet */
+struct hdr {
+	/* IPv4 checksum. Everything below this field is checksummed. */
+	uint16_t csum;
+	/* Length of the current packet */
+	uint16_t len;
+	/* Offset of the payload within the file */
+	uint16_t offset;
+	/* Size of the file.
+	   File is splitted into several packets.
+	   Must be equal for all packets. */
+	uint16_t filesz;
+	/* PACKET_DATA, PACKET_SEEK, PACKET_HASH, PACKET_CAL, PACKET_STAT,
+	   PACKET_SYNC or PACKET_INFO, maybe with PACKET_LZ or PACKET_FILL */
+	uint8_t type;
+	/* Payload */
+} __attribute__((packed));
+
+#define PACKET_DATA   AVR_UPLOAD_DATA
+#define PACKET_SEEK   AVR_UPLOAD_SEEK
+#define PACKET_HASH   0x02U
+#define PACKET_HASH_PAGES    16U
+#define PACKET_CAL    0x03U
+#define PACKET_CAL_STEPS     32U
+#define PACKET_STAT   0x04U
+#define PACKET_SYNC   0x05U
+#define PACKET_INFO   0x06U
+#define PACKET_LZ     AVR_UPLOAD_LZ
+#define PACKET_FILL   AVR_UPLOAD_FILL
+
+/* Payload of PACKET_CAL */
+struct cal {
+	uint16_t nr;
+	uint16_t low_us;
+	uint16_t cycles;
+	uint8_t osccal;
+} __attribute__((packed));
+
+/* Payload of PACKET_STAT. Counters wrap around */
+struct line_stat {
+	uint8_t framing;
+	uint8_t overrun;
+	uint8_t csum;
+	uint8_t timeout;
+} __attribute__((packed));
+
+#define INFO_LZ       0x01U
+#define INFO_FILL     0x02U
+#define INFO_HASH     0x04U
+#define INFO_CAL      0x08U
+#define INFO_STAT     0x10U
+#define INFO_SYNC     0x20U
+
+/* Payload of PACKET_INFO */
+struct dev_info {
+	/* Flash page, packet buffer and application section, in bytes */
+	uint16_t page;
+	uint16_t bufsz;
+	uint16_t flash;
+	/* Clock in MHz and the rate divider in use */
+	uint8_t mhz;
+	uint16_t ubrr;
+	uint8_t fuse_low;
+	uint8_t fuse_high;
+	/* INFO_LZ, INFO_FILL and so on */
+	uint8_t features;
+} __attribute__((packed));
+
+/* Payload of PACKET_FILL */
+struct fill {
+	uint16_t count;
+	uint8_t value;
+} __attribute__((packed));
+
+/* Runs of equal bytes this long are sent as PACKET_FILL */
+#define FILL_MIN        32U
+
+#define LZ_MATCH_MIN    3U
+#define LZ_MATCH_MAX    (0x7fU + LZ_MATCH_MIN)
+/* Compressed payloads which don't fit in place are tried shorter by this */
+#define LZ_CHUNK_STEP   16U
+
+#define ANSWER_ACK    0x00U
+#define ANSWER_NACK   0xffU
+
+/* Answer of the AVR MCU */
+struct answer {
+	/* IPv4 checksum. Everything below this field is checksummed. */
+	uint16_t csum;
+	/* Number of bytes the device is able to buffer while it processes
+	   the packet being received right after this answer. */
+	uint16_t credit;
+	/* Offset of the first byte of the file the device is missing */
+	uint16_t offset;
+	/* ANSWER_ACK or ANSWER_NACK */
+	uint8_t code;
+} __attribute__((packed));
+
+/* File image to flash */
+struct program {
+	/* Bytes upto the end of the last one the file sets, 0xFF elsewhere */
+	uint8_t *data;
+	unsigned int size;
+	/* Pages the file sets bytes of. The rest is left as the device holds it */
+	uint8_t *used;
+};
+
+/*
+	Stack each session runs on, see avr_upload_step(). The callbacks run
+	on it too. A page below is left unmapped to fault an overflow rather
+	than clobber the heap.
+ */
+#define STACK_SIZE         0x10000U
+
+struct avr_upload {
+	struct avr_upload_opts opts;
+	const struct avr_upload_ops *ops;
+	void *priv;
+	enum avr_upload_state state;
+	struct avr_upload_stats stats;
+	/* Why the session has failed */
+	char msg[256];
+
+	/* The tty, what the session waits for on it and until when */
+	int tty_fd;
+	short events;
+	long long deadline;
+	/* Contexts of the session and of whoever steps it */
+	ucontext_t ctx, caller;
+	/* Mapping of the stack, the guard page first */
+	void *stack;
+	size_t guard;
+
+	/* Whatever the session holds, released once it is over */
+	uint8_t *file;
+	size_t file_sz;
+	struct program prog;
+	uint32_t *hashes;
+
+	/* Line rate in use and the fastest one the device locked on */
+	unsigned int baud, max_baud;
+	struct termios tios;
+	/*
+		Upper bound of packet length on the line. It follows the quality of
+		the line, see line_failed() and line_passed(up).
+	 */
+	unsigned int pktsz;
+	/* Packets passed since the last failure, and as many the rate waits for */
+	unsigned int clean, clean_rate;
+	/* Shortest packets which have failed and passed at the rate in use */
+	unsigned int noisy, quiet;
+	/* Counters the device reported last */
+	struct line_stat stat;
+	/*
+		What the device is built with, see query_info(). Devices which don't
+		answer PACKET_INFO are taken for the build of `tools/link.lds` which
+		serves everything but PACKET_INFO itself.
+	 */
+	unsigned int bufsz, page, flash_sz;
+	/* Clock of the device divided by 8 as the rate in use shows, once known */
+	unsigned int clk8;
+	unsigned int features;
+};
+
+uint16_t usart_calc_csum(uint8_t *buf, uint16_t bufsz)
+{
+	uint32_t sum;
+	uint16_t *ptr;
+
+	ptr = (uint16_t *) buf;
+	sum = 0U;
+
+	while (bufsz > 1U) {
+		sum   += *(ptr++);
+		bufsz -= 2U;
+	}
+
+	if (bufsz > 0U)
+		sum   += *((uint8_t *) ptr);
+
+	while ((sum >> 16))
+		sum    = (sum & 0xffffU) + (sum >> 16);
+
+	return ~((uint16_t) sum);
+}
+
+/* CRC-32 of the page at @off, padded with 0xFF beyond @size */
+static uint32_t page_hash(const struct avr_upload *up, const uint8_t *data,
+                          unsigned int off, unsigned int size)
+{
+	uint32_t crc = 0xffffffffU;
+	unsigned int i, bit;
+
+	for (i = off; i < off + up->page; i++) {
+		crc ^= (i < size) ? data[i] : 0xffU;
+		for (bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ ((crc & 0x01U) ? 0xedb88320U : 0x00000000U);
+	}
+
+	return ~crc;
+}
+
+/*
+	Fails the session. Its stack is left for good, whoever steps it
+	gets the control back. See avr_upload_step().
+ */
+static void __attribute__((noreturn)) die(struct avr_upload *up, const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	vsnprintf(up->msg, sizeof(up->msg), msg, ap);
+	va_end(ap);
+
+	up->state = avr_upload_failed;
+	setcontext(&up->caller);
+	abort();
+}
+
+/* Passes a line of progress to the caller */
+static void note(struct avr_upload *up, enum avr_upload_note kind, const char *msg, ...)
+{
+	char line[256];
+	va_list ap;
+
+	if (kind == avr_upload_packet)
+		up->stats.packets++;
+	else if (kind == avr_upload_retry)
+		up->stats.retries++;
+	if (!up->ops->progress)
+		return;
+	va_start(ap, msg);
+	vsnprintf(line, sizeof(line), msg, ap);
+	va_end(ap);
+	up->ops->progress(up, kind, line);
+}
+
+enum verdict {
+	verdict_ack,
+	verdict_nack,
+	verdict_none,
+};
+
+long long avr_upload_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000L;
+}
+
+long long avr_upload_now_ms(void)
+{
+	return avr_upload_now_us() / 1000LL;
+}
+
+#define now_ms    avr_upload_now_ms
+#define now_us    avr_upload_now_us
+
+/* Milliseconds the line needs to carry @nbytes characters of 10 bits */
+static unsigned int line_time_ms(const struct avr_upload *up, unsigned int nbytes)
+{
+	return ((unsigned long long) nbytes * 10U * 1000U + up->baud - 1U) / up->baud;
+}
+
+/*
+	Gives the control back to the caller until the tty is ready for
+	@events or @deadline passes. The caller may step the session earlier,
+	so whatever waits has to check what it waits for once again.
+ */
+static void wait_tty(struct avr_upload *up, short events, long long deadline)
+{
+	up->events   = events;
+	up->deadline = deadline;
+	swapcontext(&up->ctx, &up->caller);
+	up->events   = 0;
+	up->deadline = -1;
+}
+
+/* Reads upto @len bytes which have arrived by @deadline. Returns 0 once it passes */
+static size_t read_tty(struct avr_upload *up, const char *what, long long deadline,
+                       uint8_t *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (1) {
+		ret = read(up->tty_fd, buf, len);
+		if (ret > 0)
+			return ret;
+		if (ret < 0 && errno != EINTR && errno != EAGAIN)
+			die(up, "%s (read): \"%s\"", what, strerror(errno));
+		if (now_ms() >= deadline)
+			return 0;
+		wait_tty(up, POLLIN, deadline);
+	}
+}
+
+/* Writes @len bytes at @buf, however long the tty takes to take them */
+static void write_tty(struct avr_upload *up, const char *what, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(up->tty_fd, ptr, len);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN)
+			die(up, "%s (write): \"%s\"", what, strerror(errno));
+		if (ret <= 0) {
+			wait_tty(up, POLLOUT, -1);
+			continue;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+}
+
+/*
+	Waits until what we have written leaves the tty. Unlike tcdrain() the output
+	queue is polled, so only what the UART itself holds is left to the kernel.
+ */
+static void drain_tty(struct avr_upload *up)
+{
+	int nr;
+
+	while (!ioctl(up->tty_fd, TIOCOUTQ, &nr) && nr > 0)
+		wait_tty(up, 0, now_ms() + 1);
+}
+
+/*
+	Waits for the device answer until @deadline.
+	The answer is reported as soon as its last byte arrives.
+	Bytes which do not form an answer with valid checksum are skipped,
+	so line noise ends up as a timeout.
+ */
+static enum verdict wait_answer(struct avr_upload *up, long long deadline,
+                                unsigned int *credit, unsigned int *offset)
+{
+	struct answer answer;
+	uint8_t *buf = (uint8_t *) &answer;
+	unsigned int nr = 0;
+	size_t ret;
+
+	while (1) {
+		ret = read_tty(up, "WAIT ANSWER", deadline, &buf[nr], sizeof(answer) - nr);
+		if (!ret)
+			return verdict_none;
+		nr += ret;
+		if (nr < sizeof(answer))
+			continue;
+		if (answer.csum == usart_calc_csum((uint8_t *) &answer.credit,
+		                                   sizeof(answer) - offsetof(struct answer, credit)) &&
+		    (answer.code == ANSWER_ACK || answer.code == ANSWER_NACK)) {
+			*credit = answer.credit;
+			*offset = answer.offset;
+			return (answer.code == ANSWER_ACK) ? verdict_ack : verdict_nack;
+		}
+		/* Line noise. Slide by one byte and look for an answer again */
+		memmove(buf, &buf[1], --nr);
+	}
+}
+
+/*
+	Waits until @deadline for the packet of @type and @len bytes into @buf.
+	Like answers, bytes which do not form a valid packet are skipped.
+ */
+static int wait_packet(struct avr_upload *up, long long deadline,
+                       unsigned int type, uint8_t *buf, unsigned int len)
+{
+	struct hdr *hdr = (struct hdr *) buf;
+	unsigned int nr = 0;
+	size_t ret;
+
+	while (1) {
+		ret = read_tty(up, "WAIT PACKET", deadline, &buf[nr], len - nr);
+		if (!ret)
+			return -1;
+		nr += ret;
+		if (nr < len)
+			continue;
+		if (hdr->len == len && hdr->type == type &&
+		    hdr->csum == usart_calc_csum((uint8_t *) &hdr->len,
+		                                 len - offsetof(struct hdr, len)))
+			return 0;
+		/* Line noise. Slide by one byte and look for the packet again */
+		memmove(buf, &buf[1], --nr);
+	}
+}
+
+/* Waits until @deadline for the packet with @nr hashes of pages starting at @off */
+static int wait_hashes(struct avr_upload *up, long long deadline,
+                       unsigned int off, unsigned int nr_hashes, uint32_t *hashes)
+{
+	uint8_t buf[sizeof(struct hdr) + PACKET_HASH_PAGES * sizeof(uint32_t)];
+	struct hdr *hdr = (struct hdr *) buf;
+
+	do {
+		if (wait_packet(up, deadline, PACKET_HASH, buf,
+		                sizeof(struct hdr) + nr_hashes * sizeof(uint32_t)))
+			return -1;
+		/* Late answer to the previous query */
+	} while (hdr->offset != off || hdr->filesz != up->flash_sz);
+	memcpy(hashes, &hdr[1], nr_hashes * sizeof(uint32_t));
+
+	return 0;
+}
+
+/*
+	Asks the device for hashes of its first @nr_pages pages at least.
+	The device answers with PACKET_HASH_PAGES hashes unless application
+	section ends earlier, so @hashes must cover the whole section.
+ */
+static void query_hashes(struct avr_upload *up, unsigned int filesz,
+                         unsigned int nr_pages, uint32_t *hashes)
+{
+	struct hdr hdr;
+	unsigned int page, nr, retries;
+
+	hdr.filesz = filesz;
+	hdr.type   = PACKET_HASH;
+	hdr.len    = sizeof(hdr);
+	retries    = 0;
+	for (page = 0; page < nr_pages; page += nr) {
+		nr         = up->flash_sz / up->page - page;
+		if (nr > PACKET_HASH_PAGES)
+			nr = PACKET_HASH_PAGES;
+		hdr.offset = page * up->page;
+		hdr.csum   = usart_calc_csum((uint8_t *) &hdr.len,
+		                             sizeof(hdr) - offsetof(struct hdr, len));
+		write_tty(up, "QUERY HASHES", &hdr, sizeof(hdr));
+		if (!wait_hashes(up, now_ms() +
+		                 line_time_ms(up, sizeof(hdr) * 2 + nr * sizeof(uint32_t)) +
+		                 HASH_SLACK_MS, hdr.offset, nr, &hashes[page])) {
+			retries = 0;
+			continue;
+		}
+		if (++retries > MAX_RETRIES)
+			die(up, "QUERY HASHES (answer): \"%s\"", "too many retries");
+		note(up, avr_upload_retry, "TIMEOUT hash query of %u - %u part",
+		     hdr.offset, hdr.offset + nr * up->page);
+		/* Anything late belongs to the previous attempt */
+		tcflush(up->tty_fd, TCIFLUSH);
+		nr         = 0;
+	}
+}
+
+/* Asks the device for error counters of the line. See PACKET_STAT */
+static int query_stat(struct avr_upload *up, struct line_stat *stat)
+{
+	uint8_t buf[sizeof(struct hdr) + sizeof(struct line_stat)];
+	struct hdr *hdr = (struct hdr *) buf;
+
+	hdr->len    = sizeof(*hdr);
+	hdr->offset = 0;
+	hdr->filesz = 0;
+	hdr->type   = PACKET_STAT;
+	hdr->csum   = usart_calc_csum((uint8_t *) &hdr->len,
+	                              sizeof(*hdr) - offsetof(struct hdr, len));
+	write_tty(up, "QUERY STAT", buf, sizeof(*hdr));
+	if (wait_packet(up, now_ms() + line_time_ms(up, sizeof(*hdr) + sizeof(buf)) +
+	                ANSWER_SLACK_MS, PACKET_STAT, buf, sizeof(buf)))
+		return -1;
+	memcpy(stat, &hdr[1], sizeof(*stat));
+
+	return 0;
+}
+
+/*
+	Tells whether the clock of the device produces @baud closely enough
+	for its autobaud to lock on. Any rate may do until PACKET_INFO tells
+	the divider. The actual clock counts, the nominal one may be off by
+	a few percent.
+ */
+static int rate_ok(const struct avr_upload *up, unsigned int baud)
+{
+	unsigned int div, real;
+
+	if (!up->clk8)
+		return 1;
+	div  = (up->clk8 + baud / 2U) / baud;
+	if (!div)
+		return 0;
+	real = up->clk8 / div;
+
+	return ((real > baud) ? real - baud : baud - real) * 64U <= baud;
+}
+
+/*
+	Asks the device what it is built with. See PACKET_INFO.
+	Devices which don't answer are left with the defaults.
+ */
+static void query_info(struct avr_upload *up)
+{
+	uint8_t buf[sizeof(struct hdr) + sizeof(struct dev_info)];
+	struct hdr *hdr = (struct hdr *) buf;
+	struct dev_info *dev = (struct dev_info *) &hdr[1];
+	unsigned int retries, rate, len;
+	char rates[sizeof(avr_rates) / sizeof(avr_rates[0]) * 8];
+
+	for (retries = 0; retries <= MAX_RETRIES; retries++) {
+		hdr->len    = sizeof(*hdr);
+		hdr->offset = 0;
+		hdr->filesz = 0;
+		hdr->type   = PACKET_INFO;
+		hdr->csum   = usart_calc_csum((uint8_t *) &hdr->len,
+		                              sizeof(*hdr) - offsetof(struct hdr, len));
+		write_tty(up, "QUERY INFO", buf, sizeof(*hdr));
+		if (!wait_packet(up, now_ms() + line_time_ms(up, sizeof(*hdr) + sizeof(buf)) +
+		                 ANSWER_SLACK_MS, PACKET_INFO, buf, sizeof(buf)))
+			break;
+	}
+	if (retries > MAX_RETRIES) {
+		note(up, avr_upload_info, "INFO is not reported, packets of %u bytes are sent",
+		     up->bufsz);
+		return;
+	}
+	/* Pages are whole, and packets are able to carry a payload */
+	if (!dev->page || (dev->page & (dev->page - 1)) || dev->flash % dev->page ||
+	    dev->bufsz <= sizeof(struct hdr) + sizeof(struct fill) ||
+	    dev->bufsz > USART_BUFSZ_MAX)
+		die(up, "QUERY INFO (invalid): page %u, buffer %u, flash %u",
+		    dev->page, dev->bufsz, dev->flash);
+	up->page     = dev->page;
+	up->bufsz    = dev->bufsz;
+	up->flash_sz = dev->flash;
+	up->clk8     = up->baud * (dev->ubrr + 1U);
+	up->features = dev->features;
+	for (rate = 0, len = 0; rate < sizeof(avr_rates) / sizeof(avr_rates[0]); rate++)
+		if (rate_ok(up, avr_rates[rate].baud))
+			len += snprintf(&rates[len], sizeof(rates) - len, " %u", avr_rates[rate].baud);
+	note(up, avr_upload_info, "INFO page %u, buffer %u, flash %u bytes, %u MHz, "
+	     "fuses 0x%02x 0x%02x, features 0x%02x, rates%s",
+	     up->page, up->bufsz, up->flash_sz, dev->mhz, dev->fuse_low, dev->fuse_high,
+	     up->features, rates);
+}
+
+/*
+	Finds the rate the device runs at. The sync is sent at every rate,
+	starting from the fastest one upto @max_baud, until the device answers.
+	With @baud set only that rate is tried.
+ */
+static void sync_device(struct avr_upload *up, unsigned int baud, unsigned int max_baud)
+{
+	uint8_t sync[SYNC_NR];
+	unsigned int rate, retries, credit, offset;
+	long long deadline;
+
+	memset(sync, SYNC_CHAR, sizeof(sync));
+	for (retries = 0; retries <= MAX_RETRIES; retries++) {
+		for (rate = 0; rate < sizeof(avr_rates) / sizeof(avr_rates[0]); rate++) {
+			if ((baud && avr_rates[rate].baud != baud) ||
+			    (max_baud && avr_rates[rate].baud > max_baud) ||
+			    !rate_ok(up, avr_rates[rate].baud))
+				continue;
+			cfsetispeed(&up->tios, avr_rates[rate].speed);
+			cfsetospeed(&up->tios, avr_rates[rate].speed);
+			/* The previous sync leaves the line before the rate changes */
+			drain_tty(up);
+			if (tcsetattr(up->tty_fd, TCSADRAIN, &up->tios) < 0)
+				die(up, "SYNC (tcsetattr): \"%s\"", strerror(errno));
+			tcflush(up->tty_fd, TCIFLUSH);
+			up->baud = avr_rates[rate].baud;
+
+			write_tty(up, "SYNC", sync, sizeof(sync));
+			deadline = now_ms() + ANSWER_SLACK_MS +
+			           line_time_ms(up, sizeof(sync) + sizeof(struct answer));
+			if (wait_answer(up, deadline, &credit, &offset) == verdict_none)
+				continue;
+			/* The rest of the sync is NACKed as damaged packets. Drop that */
+			while (wait_answer(up, now_ms() + ANSWER_SLACK_MS,
+			                   &credit, &offset) != verdict_none) ;
+			tcflush(up->tty_fd, TCIFLUSH);
+			up->stats.baud = up->baud;
+			note(up, avr_upload_info, "SYNC at %u bps", up->baud);
+			/* Errors of the sync itself don't count */
+			if (up->features & INFO_STAT)
+				query_stat(up, &up->stat);
+			return;
+		}
+	}
+	die(up, "SYNC (answer): \"%s\"", "no answer at any rate");
+}
+
+/*
+	Calibrates the clock of the device against the sync we send after
+	PACKET_CAL. The device stores the OSCCAL value found in its EEPROM,
+	it is used since the next reset.
+ */
+static void calibrate(struct avr_upload *up)
+{
+	uint8_t buf[sizeof(struct hdr) + sizeof(struct cal)];
+	struct hdr *hdr = (struct hdr *) buf;
+	struct cal *cal = (struct cal *) &hdr[1];
+	struct cal req;
+	uint8_t sync[256];
+	unsigned int total, n, len, retries, credit, offset;
+
+	/* Each SYNC_CHAR keeps RXD low for 8 bit times */
+	req.nr     = (unsigned long long) CAL_LOW_US * up->baud / (8U * 1000000U);
+	if (!req.nr)
+		req.nr = 1;
+	req.low_us = ((unsigned long long) req.nr * 8U * 1000000U + up->baud / 2U) / up->baud;
+	req.cycles = 0;
+	req.osccal = 0;
+	total      = (PACKET_CAL_STEPS + 2U) * (req.nr + 2U);
+	memset(sync, SYNC_CHAR, sizeof(sync));
+
+	for (retries = 0; retries <= MAX_RETRIES; retries++) {
+		hdr->len    = sizeof(buf);
+		hdr->offset = 0;
+		hdr->filesz = 0;
+		hdr->type   = PACKET_CAL;
+		memcpy(cal, &req, sizeof(req));
+		hdr->csum   = usart_calc_csum((uint8_t *) &hdr->len,
+		                              sizeof(buf) - offsetof(struct hdr, len));
+		write_tty(up, "CALIBRATE", buf, sizeof(buf));
+		for (n = 0; n < total; n += len) {
+			len = (total - n < sizeof(sync)) ? total - n : sizeof(sync);
+			write_tty(up, "CALIBRATE", sync, len);
+		}
+		if (!wait_packet(up, now_ms() + line_time_ms(up, total + sizeof(buf)) + CAL_SLACK_MS,
+		                 PACKET_CAL, buf, sizeof(buf))) {
+			note(up, avr_upload_info, "CALIBRATE OSCCAL 0x%02x, %u cycles in %u us, "
+			     "used since the next reset", cal->osccal, cal->cycles, cal->low_us);
+			return;
+		}
+		note(up, avr_upload_retry, "TIMEOUT calibration");
+		/* The sync after a damaged request is NACKed. Let that pass */
+		while (wait_answer(up, now_ms() + ANSWER_SLACK_MS,
+		                   &credit, &offset) != verdict_none) ;
+		tcflush(up->tty_fd, TCIFLUSH);
+	}
+	die(up, "CALIBRATE (answer): \"%s\"", "too many retries");
+}
+
+/*
+	Moves the line to the fastest rate upto @max_baud the device locks on.
+	Unless the device acknowledges the request, the sync is sent at the rate
+	in use: the device either has missed the request and NACKs the sync as
+	a damaged packet, or its answer is lost and it measures the sync.
+ */
+static void resync(struct avr_upload *up, unsigned int max_baud)
+{
+	struct hdr hdr;
+	unsigned int credit, offset;
+
+	hdr.len    = sizeof(hdr);
+	hdr.offset = 0;
+	hdr.filesz = 0;
+	hdr.type   = PACKET_SYNC;
+	hdr.csum   = usart_calc_csum((uint8_t *) &hdr.len,
+	                             sizeof(hdr) - offsetof(struct hdr, len));
+	write_tty(up, "RESYNC", &hdr, sizeof(hdr));
+	if (wait_answer(up, now_ms() + line_time_ms(up, sizeof(hdr) + sizeof(struct answer)) +
+	                ANSWER_SLACK_MS, &credit, &offset) == verdict_ack)
+		sync_device(up, 0, max_baud);
+	else
+		sync_device(up, up->baud, 0);
+	up->clean = 0;
+	up->noisy = 0;
+	up->quiet = 0;
+}
+
+/*
+	Adapts the line to a packet which failed. Errors the device has counted
+	since tell noise from overload. Noise damages characters, and a shorter
+	packet is more likely to pass it. Overruns mean the device doesn't keep
+	up with the rate. The rate goes down then, and so it does if the shortest
+	packets fail more often than they pass. Slower rates take longer for
+	every byte, so that's the only noise they are worth for.
+	Returns non-zero if the line has changed.
+ */
+static int line_failed(struct avr_upload *up)
+{
+	struct line_stat stat;
+	unsigned int noise, overrun, passed;
+
+	passed    = up->clean;
+	up->clean = 0;
+	if (!(up->features & INFO_STAT) || query_stat(up, &stat)) {
+		/* Counters are unknown, or even a short answer doesn't pass */
+		noise    = 1;
+		overrun  = 0;
+	} else {
+		noise    = (uint8_t) (stat.framing - up->stat.framing) +
+		           (uint8_t) (stat.csum - up->stat.csum) +
+		           (uint8_t) (stat.timeout - up->stat.timeout);
+		overrun  = (uint8_t) (stat.overrun - up->stat.overrun);
+		up->stat = stat;
+	}
+	/* Only the answer is lost */
+	if (!noise && !overrun)
+		return 0;
+	if (!overrun && up->pktsz > PKTSZ_MIN) {
+		up->pktsz /= 2;
+		if (up->pktsz < PKTSZ_MIN)
+			up->pktsz = PKTSZ_MIN;
+		note(up, avr_upload_info, "LINE packets of %u bytes", up->pktsz);
+		return 1;
+	}
+	if (!overrun) {
+		up->noisy++;
+		up->quiet += passed;
+		if (up->noisy < NOISY_FAILURES || up->noisy <= up->quiet)
+			return 0;
+	}
+	if (!(up->features & INFO_SYNC) ||
+	    up->baud == avr_rates[sizeof(avr_rates) / sizeof(avr_rates[0]) - 1].baud)
+		return 0;
+	note(up, avr_upload_info, "LINE %u noise, %u overrun errors at %u bps",
+	     noise, overrun, up->baud);
+	/* Faster rates have to earn their turn again */
+	up->clean_rate *= 2;
+	resync(up, up->baud - 1);
+
+	return 1;
+}
+
+/*
+	Counts a packet which has passed. Every CLEAN_PACKETS in a row packets
+	grow back, and once they are the longest for `up->clean_rate` packets
+	a faster rate is due. Returns non-zero then, the rate is changed
+	with nothing in flight.
+ */
+static int line_passed(struct avr_upload *up)
+{
+	if (++up->clean % CLEAN_PACKETS)
+		return 0;
+	if (up->pktsz < up->bufsz) {
+		up->pktsz *= 2;
+		if (up->pktsz > up->bufsz)
+			up->pktsz = up->bufsz;
+		note(up, avr_upload_info, "LINE packets of %u bytes", up->pktsz);
+		up->clean = 0;
+		up->noisy = 0;
+		up->quiet = 0;
+		return 0;
+	}
+
+	return up->clean >= up->clean_rate && up->baud < up->max_baud &&
+	       (up->features & INFO_SYNC);
+}
+
+/* Packet sent but not answered yet */
+struct inflight {
+	/* File bytes the packet carries and its size on the line */
+	unsigned int off, size, len;
+	uint8_t type;
+	/* Time the device spends on the packet besides the usual */
+	unsigned int busy_ms;
+	long long deadline;
+	/* See struct avr_upload_packet */
+	long long write_us, sent_us;
+	unsigned int retries;
+};
+
+/* Appends literal run of @nr bytes at @src to compressed stream @dst */
+static unsigned int lz_literals(const uint8_t *src, unsigned int nr,
+                                uint8_t *dst, unsigned int out)
+{
+	unsigned int n;
+
+	while (nr > 0) {
+		n = (nr > 0x80U) ? 0x80U : nr;
+		dst[out++] = n - 1;
+		memcpy(&dst[out], src, n);
+		out += n;
+		src += n;
+		nr  -= n;
+	}
+
+	return out;
+}
+
+/*
+	Tells whether the device is able to expand @clen bytes at @dst in place
+	within @cap bytes. Mirrors the checks of lz_inflate().
+ */
+static int lz_fits(const uint8_t *dst, unsigned int clen, unsigned int cap)
+{
+	long in = cap - clen, out = 0;
+	unsigned int i = 0, n;
+
+	while (i < clen) {
+		n = dst[i++];
+		in++;
+		if (!(n & 0x80U)) {
+			i   += n + 1;
+			in  += n + 1;
+			out += n + 1;
+			continue;
+		}
+		i++;
+		in++;
+		n    = (n & 0x7fU) + LZ_MATCH_MIN;
+		if ((long) n > in - out)
+			return 0;
+		out += n;
+	}
+
+	return 1;
+}
+
+/*
+	Compresses @size bytes at @src into @dst in the format of `base/lz.c`.
+	Greedy parsing, the nearest of the longest matches wins.
+	Returns the compressed size, or zero unless it is shorter than @size
+	and the device is able to expand it in place within @cap bytes.
+ */
+static unsigned int lz_deflate(const uint8_t *src, unsigned int size,
+                               uint8_t *dst, unsigned int cap)
+{
+	unsigned int i, j, k, lit, best, dist, out;
+
+	out = 0;
+	lit = 0;
+	for (i = 0; i < size; ) {
+		best = 0;
+		dist = 0;
+		for (j = (i > 0x100U) ? i - 0x100U : 0; j < i; j++) {
+			for (k = 0; i + k < size && k < LZ_MATCH_MAX && src[j + k] == src[i + k]; k++)
+				;
+			if (k >= best) {
+				best = k;
+				dist = i - j - 1;
+			}
+		}
+		if (best < LZ_MATCH_MIN) {
+			i++;
+			continue;
+		}
+		out = lz_literals(&src[lit], i - lit, dst, out);
+		if (out + 2 >= size)
+			return 0;
+		dst[out++] = 0x80U | (best - LZ_MATCH_MIN);
+		dst[out++] = dist;
+		i  += best;
+		lit = i;
+	}
+	out = lz_literals(&src[lit], i - lit, dst, out);
+
+	return (out < size && lz_fits(dst, out, cap)) ? out : 0;
+}
+
+/* Length of the run of bytes equal to @data[@off], upto @end */
+static unsigned int run_length(const uint8_t *data, unsigned int off, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = off + 1; i < end && data[i] == data[off]; i++)
+		;
+
+	return i - off;
+}
+
+/*
+	Builds in @msgbuf the packet with bytes of @data from @off upto @end.
+	Runs of equal bytes go as PACKET_FILL, and other packets stop short of
+	them. With @lz set, the payload is compressed if that takes less time on
+	the line per file byte. Compressed payload has to be expanded in place,
+	so a shorter one may be picked. Returns the number of file bytes it carries.
+ */
+static unsigned int make_part(const struct avr_upload *up, uint8_t *msgbuf,
+                              const uint8_t *data, unsigned int off,
+                              unsigned int end, uint8_t type, int lz)
+{
+	const unsigned int pldsz = up->pktsz - sizeof(struct hdr);
+	/* The device expands compressed payload within its whole buffer */
+	const unsigned int cap = up->bufsz - sizeof(struct hdr);
+	struct hdr *hdr = (struct hdr *) msgbuf;
+	struct fill *fill = (struct fill *) &hdr[1];
+	uint8_t lzbuf[USART_BUFSZ_MAX];
+	unsigned int n, clen, size, best_n, best_clen;
+
+	size = run_length(data, off, end);
+	if (size >= FILL_MIN && (up->features & INFO_FILL)) {
+		if (size > 0xffffU)
+			size = 0xffffU;
+		fill->count = size;
+		fill->value = data[off];
+		type       |= PACKET_FILL;
+		best_n      = size;
+		best_clen   = sizeof(*fill);
+		goto out;
+	}
+
+	size = end - off;
+	if (size > pldsz)
+		size = pldsz;
+	for (n = 1; (up->features & INFO_FILL) && n + FILL_MIN <= size; n++) {
+		if (run_length(data, off + n, off + n + FILL_MIN) == FILL_MIN) {
+			size = n;
+			break;
+		}
+	}
+
+	best_n    = size;
+	best_clen = size;
+	for (n = size; lz && n > LZ_CHUNK_STEP; n -= LZ_CHUNK_STEP) {
+		clen = lz_deflate(&data[off], n, lzbuf, cap);
+		if (clen && (clen + sizeof(struct hdr)) * best_n <
+		            (best_clen + sizeof(struct hdr)) * n) {
+			best_n    = n;
+			best_clen = clen;
+		}
+	}
+
+	if (best_clen < best_n) {
+		lz_deflate(&data[off], best_n, (uint8_t *) &hdr[1], cap);
+		type |= PACKET_LZ;
+	} else {
+		memcpy(&hdr[1], &data[off], best_n);
+	}
+out:
+	hdr->offset = off;
+	hdr->type = type;
+	hdr->len  = best_clen + sizeof(struct hdr);
+	hdr->csum = usart_calc_csum((uint8_t *) &hdr->len,
+	                            hdr->len - offsetof(struct hdr, len));
+
+	return best_n;
+}
+
+static void send_part(struct avr_upload *up, const uint8_t *msgbuf, struct inflight *pkt)
+{
+	const struct hdr *hdr = (const struct hdr *) msgbuf;
+
+	pkt->write_us = now_us();
+	write_tty(up, "UPLOAD PROGRAM", hdr, hdr->len);
+	pkt->sent_us  = now_us();
+}
+
+/* Passes the packet which leaves the window to the caller */
+static void report(struct avr_upload *up, const struct inflight *pkt,
+                   enum avr_upload_result result)
+{
+	struct avr_upload_packet rec;
+
+	if (!up->ops->packet)
+		return;
+	rec.off       = pkt->off;
+	rec.size      = pkt->size;
+	rec.len       = pkt->len;
+	rec.type      = pkt->type;
+	rec.baud      = up->baud;
+	rec.retries   = pkt->retries;
+	rec.result    = result;
+	rec.write_us  = pkt->write_us;
+	rec.sent_us   = pkt->sent_us;
+	rec.answer_us = now_us();
+	up->ops->packet(up, &rec);
+}
+
+/*
+	Sliding window transfer of the run of file bytes from @start upto @end.
+	The oldest packet in flight is the one the device receives into its
+	packet buffer. Packets behind it must fit the credit reported with the
+	latest answer. Answers are cumulative: whatever lies below the offset
+	the device reports is stored. Upon failure we wait out answers to the
+	rest of the window and resend starting from that offset. The device drops
+	payload it already has, so resending is always safe.
+	The first packet of the run is PACKET_SEEK, so the device skips pages
+	below it. Should that packet be lost, the device reports the end of the
+	previous run and we start over from @start.
+ */
+static void upload_run(struct avr_upload *up, uint8_t *msgbuf, const uint8_t *data,
+                       unsigned int start, unsigned int end, int lz)
+{
+	struct inflight win[MAX_INFLIGHT], *pkt;
+	unsigned int head, nr, queued, busy_ms, sent_off, acked, offset, credit, retries, backoff;
+	unsigned int sent_max, resends;
+	enum verdict verdict;
+	int faster;
+
+	/* Nothing is known about device buffering until the first answer */
+	credit   = 0;
+	head     = 0;
+	nr       = 0;
+	queued   = 0;
+	busy_ms  = 0;
+	sent_off = start;
+	acked    = start;
+	sent_max = start;
+	retries  = 0;
+	resends  = 0;
+	backoff  = 1;
+	faster   = 0;
+	while (acked < end) {
+		/* Fill the window. A faster rate waits for it to drain */
+		while (!faster && sent_off < end && nr < MAX_INFLIGHT) {
+			const struct hdr *hdr = (const struct hdr *) msgbuf;
+			unsigned int size;
+
+			size = make_part(up, msgbuf, data, sent_off, end,
+			                 (sent_off == start) ? PACKET_SEEK : PACKET_DATA, lz);
+			if (nr > 0 && queued + hdr->len > credit)
+				break;
+			pkt           = &win[(head + nr) % MAX_INFLIGHT];
+			pkt->off      = sent_off;
+			pkt->size     = size;
+			pkt->len      = hdr->len;
+			pkt->type     = hdr->type;
+			pkt->retries  = (sent_off < sent_max) ? resends : 0;
+			/* Fill is answered once its pages are loaded */
+			pkt->busy_ms  = (hdr->type & PACKET_FILL) ?
+			                (size / up->page + 2) * PAGE_WRITE_MS : 0;
+			send_part(up, msgbuf, pkt);
+			if (nr > 0)
+				queued   += pkt->len;
+			busy_ms      += pkt->busy_ms;
+			nr++;
+			sent_off     += size;
+			if (sent_max < sent_off)
+				sent_max = sent_off;
+			/* Everything in flight passes the line before this answer */
+			pkt->deadline = now_ms() +
+			                backoff * (line_time_ms(up, win[head].len + queued +
+			                                        nr * sizeof(struct answer)) +
+			                           ANSWER_SLACK_MS + busy_ms);
+		}
+
+		pkt     = &win[head];
+		verdict = wait_answer(up, pkt->deadline, &credit, &offset);
+		if (verdict != verdict_none && offset > acked && offset <= sent_off)
+			acked = offset;
+		/* Retire everything the answer covers */
+		while (nr > 0 && win[head].off + win[head].size <= acked) {
+			note(up, avr_upload_packet, "COMPLETE transmission of %u - %u part",
+			     win[head].off, win[head].off + win[head].size);
+			report(up, &win[head], avr_upload_acked);
+			busy_ms -= win[head].busy_ms;
+			head    = (head + 1) % MAX_INFLIGHT;
+			if (--nr > 0)
+				queued -= win[head].len;
+			retries = 0;
+			resends = 0;
+			backoff = 1;
+			faster |= line_passed(up);
+		}
+		if (faster && !nr && acked < end) {
+			resync(up, up->max_baud);
+			faster = 0;
+			continue;
+		}
+		/* Stray NACK with nothing in flight changes nothing */
+		if (verdict == verdict_ack || !nr)
+			continue;
+
+		pkt = &win[head];
+		report(up, pkt, (verdict == verdict_none) ? avr_upload_timeout : avr_upload_nacked);
+		if (++retries > MAX_RETRIES)
+			die(up, "UPLOAD PROGRAM (answer): \"%s\"", "too many retries");
+		resends++;
+		if (verdict == verdict_none) {
+			/* Back off. The device may be busy or the line is lost */
+			if (line_time_ms(up, up->bufsz) * backoff * 2U <= ANSWER_TMO_MAX_MS)
+				backoff *= 2U;
+			note(up, avr_upload_retry, "TIMEOUT transmission of %u - %u part",
+			     pkt->off, pkt->off + pkt->size);
+		} else {
+			note(up, avr_upload_retry, "REPEAT transmission of %u - %u part",
+			     pkt->off, pkt->off + pkt->size);
+		}
+		/* Answers to the rest of the window may still move acknowledged offset */
+		while (nr > 1) {
+			head    = (head + 1) % MAX_INFLIGHT;
+			nr--;
+			if (wait_answer(up, win[head].deadline, &credit, &offset) != verdict_none &&
+			    offset > acked && offset <= sent_off)
+				acked = offset;
+			report(up, &win[head], (win[head].off + win[head].size <= acked) ?
+			                       avr_upload_acked : avr_upload_dropped);
+		}
+		nr       = 0;
+		queued   = 0;
+		busy_ms  = 0;
+		sent_off = acked;
+		/* Anything late belongs to the previous attempt */
+		tcflush(up->tty_fd, TCIFLUSH);
+		/* Another setting of the line starts its retries over */
+		if (line_failed(up)) {
+			retries = 0;
+			backoff = 1;
+		}
+	}
+}
+
+/* Sets @nr bytes of the program at flash address @addr */
+static void program_set(struct avr_upload *up, unsigned long addr,
+                        const uint8_t *src, unsigned long nr)
+{
+	struct program *prog = &up->prog;
+	unsigned long page;
+
+	if (addr > up->flash_sz || nr > up->flash_sz - addr)
+		die(up, "LOAD (address): 0x%lx - 0x%lx is beyond flash", addr, addr + nr);
+	if (!nr)
+		return;
+	memcpy(&prog->data[addr], src, nr);
+	for (page = addr / up->page; page <= (addr + nr - 1) / up->page; page++)
+		prog->used[page] = 1;
+	if (prog->size < addr + nr)
+		prog->size = addr + nr;
+}
+
+/*
+	Loads PT_LOAD segments of ELF file. Segments are placed at their
+	physical addresses, which are flash addresses for the sections
+	the device keeps in flash. RAM and EEPROM lie above flash in AVR address
+	space and are skipped.
+ */
+static void load_elf(struct avr_upload *up, const uint8_t *file, size_t len)
+{
+	const Elf32_Ehdr *eh = (const Elf32_Ehdr *) file;
+	const Elf32_Phdr *ph;
+	unsigned int i;
+
+	if (len < sizeof(*eh) || memcmp(eh->e_ident, ELFMAG, SELFMAG) ||
+	    eh->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_AVR ||
+	    eh->e_phentsize != sizeof(*ph) ||
+	    eh->e_phoff > len || (size_t) eh->e_phnum * sizeof(*ph) > len - eh->e_phoff)
+		die(up, "LOAD (elf): \"%s\"", "not an AVR executable");
+	for (i = 0; i < eh->e_phnum; i++) {
+		ph = (const Elf32_Phdr *) (file + eh->e_phoff + i * sizeof(*ph));
+		if (ph->p_type != PT_LOAD || !ph->p_filesz)
+			continue;
+		if (ph->p_offset > len || ph->p_filesz > len - ph->p_offset)
+			die(up, "LOAD (elf): \"%s\"", "segment is beyond the file");
+		if (ph->p_paddr >= ELF_AVR_RAM) {
+			note(up, avr_upload_info, "LOAD skips %u bytes at 0x%x, not flash",
+			     ph->p_filesz, ph->p_paddr);
+			continue;
+		}
+		program_set(up, ph->p_paddr, file + ph->p_offset, ph->p_filesz);
+	}
+}
+
+/* Value of @nr hex digits at @s, or -1 */
+static long hex_value(const char *s, unsigned int nr)
+{
+	long value = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (s[i] >= '0' && s[i] <= '9')
+			value = value * 16 + s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			value = value * 16 + s[i] - 'a' + 10;
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			value = value * 16 + s[i] - 'A' + 10;
+		else
+			return -1;
+	}
+
+	return value;
+}
+
+/*
+	Tells whether @file starts with a whole Intel HEX record: the colon,
+	as many hex digits as its length field says, a checksum which holds
+	and the end of the line. A flat image which merely starts with ':'
+	doesn't pass.
+ */
+static int ihex_first_record(const char *file, size_t len)
+{
+	unsigned int nr, i, sum;
+	long value;
+
+	if (len < 3 || file[0] != ':' || (value = hex_value(file + 1, 2)) < 0)
+		return 0;
+	nr = value + 5;
+	if (len < 1 + nr * 2)
+		return 0;
+	for (i = 0, sum = 0; i < nr; i++) {
+		if ((value = hex_value(file + 1 + i * 2, 2)) < 0)
+			return 0;
+		sum += value;
+	}
+
+	return !(sum & 0xffU) &&
+	       (len == 1 + nr * 2 || file[1 + nr * 2] == '\r' || file[1 + nr * 2] == '\n');
+}
+
+/* Tells whether @path is named like an Intel HEX file */
+static int ihex_name(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+
+	return ext && (!strcasecmp(ext, ".hex") || !strcasecmp(ext, ".ihex"));
+}
+
+/*
+	Loads data records of Intel HEX file. Extended segment and linear
+	address records move the base of the records which follow.
+	Start address records mean nothing to the device.
+ */
+static void load_ihex(struct avr_upload *up, const char *file, size_t len)
+{
+	uint8_t rec[5 + 0xff];
+	unsigned long base = 0;
+	unsigned int line = 1, nr, i, sum;
+	const char *s = file, *end = file + len;
+	long value;
+
+	while (s < end) {
+		/* Line ends and blank lines are skipped */
+		if (*s == '\n')
+			line++;
+		if (*s == '\r' || *s == '\n') {
+			s++;
+			continue;
+		}
+		if (*s != ':' || end - s < 3 || (value = hex_value(s + 1, 2)) < 0 ||
+		    end - s < 1 + (value + 5) * 2)
+			die(up, "LOAD (ihex): line %u is malformed", line);
+		/* Length, address, type, data and checksum */
+		nr  = value + 5;
+		sum = 0;
+		for (i = 0; i < nr; i++) {
+			if ((value = hex_value(s + 1 + i * 2, 2)) < 0)
+				die(up, "LOAD (ihex): line %u is malformed", line);
+			rec[i] = value;
+			sum   += value;
+		}
+		if (sum & 0xffU)
+			die(up, "LOAD (ihex): line %u fails its checksum", line);
+		s  += 1 + nr * 2;
+		switch (rec[3]) {
+		case 0x00:
+			program_set(up, base + (rec[1] << 8 | rec[2]), &rec[4], rec[0]);
+			break;
+		case 0x01:
+			return;
+		case 0x02:
+		case 0x04:
+			if (rec[0] != 2)
+				die(up, "LOAD (ihex): line %u is malformed", line);
+			base = (unsigned long) (rec[4] << 8 | rec[5]) << ((rec[3] == 0x02) ? 4 : 16);
+			break;
+		case 0x03:
+		case 0x05:
+			break;
+		default:
+			die(up, "LOAD (ihex): line %u has unknown type 0x%02x", line, rec[3]);
+		}
+	}
+	die(up, "LOAD (ihex): \"%s\"", "no end of file record");
+}
+
+
+/*
+	Tells whether @page is to be sent: the file sets bytes of it and,
+	if @hashes are known, the device holds something else there.
+ */
+static int page_differs(const struct avr_upload *up, const uint32_t *hashes,
+                        unsigned int page)
+{
+	const struct program *prog = &up->prog;
+
+	return prog->used[page] &&
+	       (!hashes || hashes[page] != page_hash(up, prog->data, page * up->page, prog->size));
+}
+
+/*
+	Uploads the file. ELF and Intel HEX files are loaded where they say,
+	other files are flat images of flash from address 0. The format is
+	guessed unless `format` tells it. Only pages the
+	file sets bytes of are sent, each run of them starts with PACKET_SEEK.
+	Unless `full` is set, the device is asked for hashes of its pages first
+	and only pages which differ are sent. The last page is always sent,
+	since it completes the upload on the device side.
+	With `lz` set, payloads are compressed.
+ */
+static void upload_program(struct avr_upload *up)
+{
+	uint8_t msgbuf[USART_BUFSZ_MAX];
+	struct program *prog = &up->prog;
+	unsigned int page, last, start, nr_sent, nr_used;
+	enum avr_upload_format format;
+	struct stat st;
+	void *file;
+	int fd;
+
+	fd = open(up->opts.path, O_RDONLY);
+	if (fd < 0)
+		die(up, "UPLOAD PROGRAM (open): \"%s\"", strerror(errno));
+	if (fstat(fd, &st) < 0 || !st.st_size) {
+		close(fd);
+		die(up, "UPLOAD PROGRAM (invalid size): %u", 0);
+	}
+	file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED)
+		die(up, "UPLOAD PROGRAM (mmap): \"%s\"", strerror(errno));
+	up->file    = file;
+	up->file_sz = st.st_size;
+
+	prog->data = malloc(up->flash_sz);
+	prog->used = calloc(up->flash_sz / up->page, 1);
+	if (!prog->data || !prog->used)
+		die(up, "UPLOAD PROGRAM (malloc): \"%s\"", strerror(errno));
+	memset(prog->data, 0xff, up->flash_sz);
+	prog->size = 0;
+	format     = up->opts.format;
+	if (format == avr_upload_auto) {
+		if (up->file_sz >= SELFMAG && !memcmp(up->file, ELFMAG, SELFMAG))
+			format = avr_upload_elf;
+		else if (ihex_name(up->opts.path) ||
+		         ihex_first_record((const char *) up->file, up->file_sz))
+			format = avr_upload_ihex;
+		else
+			format = avr_upload_bin;
+	}
+	if (format == avr_upload_elf)
+		load_elf(up, up->file, up->file_sz);
+	else if (format == avr_upload_ihex)
+		load_ihex(up, (const char *) up->file, up->file_sz);
+	else
+		program_set(up, 0, up->file, up->file_sz);
+	munmap(up->file, up->file_sz);
+	up->file = NULL;
+	if (!prog->size)
+		die(up, "UPLOAD PROGRAM (invalid size): %u", prog->size);
+
+	((struct hdr *) msgbuf)->filesz = prog->size;
+	last    = (prog->size - 1) / up->page;
+	for (page = 0, nr_used = 0; page <= last; page++)
+		nr_used += prog->used[page];
+	if (nr_used <= last)
+		note(up, avr_upload_info, "SPARSE %u of %u pages are set by the file",
+		     nr_used, last + 1);
+
+	if (!up->opts.full) {
+		/* The device answers with hashes upto the end of its flash */
+		up->hashes = malloc(up->flash_sz / up->page * sizeof(*up->hashes));
+		if (!up->hashes)
+			die(up, "UPLOAD PROGRAM (malloc): \"%s\"", strerror(errno));
+		query_hashes(up, prog->size, last + 1, up->hashes);
+	}
+	nr_sent = 0;
+	for (page = 0; page <= last; page = start) {
+		/* Find the next run of pages to send */
+		while (page < last && !page_differs(up, up->hashes, page))
+			page++;
+		for (start = page; start <= last; start++) {
+			if (start > page && start < last && !page_differs(up, up->hashes, start))
+				break;
+		}
+		nr_sent += start - page;
+		upload_run(up, msgbuf, prog->data, page * up->page,
+		           (start > last) ? prog->size : start * up->page, up->opts.lz);
+	}
+	if (!up->opts.full)
+		note(up, avr_upload_info, "DELTA %u of %u pages sent", nr_sent, last + 1);
+}
+
+/* Flashes the file to the device, see struct avr_upload_opts */
+static void flash_device(struct avr_upload *up)
+{
+	up->tty_fd = open(up->opts.tty, O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
+	if (up->tty_fd < 0)
+		die(up, "ERROR (open): \"%s\"", strerror(errno));
+
+	if (tcgetattr(up->tty_fd, &up->tios) < 0)
+		die(up, "ERROR (tcgetattr): \"%s\"", strerror(errno));
+
+	up->tios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
+	up->tios.c_oflag &= ~(OPOST);
+	up->tios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+	up->tios.c_cflag &= ~(CSIZE | PARENB);
+	up->tios.c_cflag |= CS8;
+	/* Answers are awaited by the caller with our own deadlines. No termios timers */
+	up->tios.c_cc[VMIN]  = 0;
+	up->tios.c_cc[VTIME] = 0;
+
+	if (tcsetattr(up->tty_fd, TCSANOW, &up->tios) < 0)
+		die(up, "ERROR (tcsetattr): \"%s\"", strerror(errno));
+	/* Drop whatever the device said before we came */
+	if (tcflush(up->tty_fd, TCIOFLUSH) < 0)
+		die(up, "ERROR (tcflush): \"%s\"", strerror(errno));
+
+	sync_device(up, up->opts.baud, 0);
+	up->max_baud = up->baud;
+	query_info(up);
+	if (up->opts.pktsz && up->opts.pktsz < up->bufsz)
+		up->bufsz = up->opts.pktsz;
+	up->pktsz    = up->bufsz;
+	/* Fall back to what the device serves */
+	if (!(up->features & INFO_HASH))
+		up->opts.full = 1;
+	if (!(up->features & INFO_LZ))
+		up->opts.lz   = 0;
+	if (up->opts.cal && !(up->features & INFO_CAL))
+		die(up, "CALIBRATE (info): \"%s\"", "not supported by the device");
+	if (up->opts.cal)
+		calibrate(up);
+
+	upload_program(up);
+}
+
+/* Releases whatever the session holds once it is over */
+static void release(struct avr_upload *up)
+{
+	if (up->tty_fd >= 0)
+		close(up->tty_fd);
+	if (up->file)
+		munmap(up->file, up->file_sz);
+	free(up->hashes);
+	free(up->prog.used);
+	free(up->prog.data);
+	if (up->stack)
+		munmap(up->stack, STACK_SIZE + up->guard);
+	up->tty_fd    = -1;
+	up->file      = NULL;
+	up->hashes    = NULL;
+	up->prog.used = NULL;
+	up->prog.data = NULL;
+	up->stack     = NULL;
+	up->events    = 0;
+	up->deadline  = -1;
+}
+
+/* The session on its own stack. makecontext() passes the pointer in halves */
+static void run(unsigned int hi, unsigned int lo)
+{
+	struct avr_upload *up = (struct avr_upload *) ((uintptr_t) hi << 16 << 16 | lo);
+
+	flash_device(up);
+	up->state = avr_upload_done;
+}
+
+int avr_upload_baud_ok(unsigned int baud)
+{
+	unsigned int rate;
+
+	for (rate = 0; rate < sizeof(avr_rates) / sizeof(avr_rates[0]); rate++)
+		if (avr_rates[rate].baud == baud)
+			return 1;
+
+	return 0;
+}
+
+int avr_upload_pktsz_ok(unsigned int pktsz)
+{
+	return pktsz >= PKTSZ_MIN && pktsz <= USART_BUFSZ_MAX;
+}
+
+struct avr_upload *avr_upload_new(const struct avr_upload_opts *opts,
+                                  const struct avr_upload_ops *ops, void *priv)
+{
+	struct avr_upload *up;
+
+	if ((opts->baud && !avr_upload_baud_ok(opts->baud)) ||
+	    (opts->pktsz && !avr_upload_pktsz_ok(opts->pktsz))) {
+		errno = EINVAL;
+		return NULL;
+	}
+	up = calloc(1, sizeof(*up));
+	if (!up)
+		return NULL;
+	up->opts       = *opts;
+	up->ops        = ops;
+	up->priv       = priv;
+	up->state      = avr_upload_busy;
+	up->tty_fd     = -1;
+	up->deadline   = -1;
+	up->clean_rate = 4U * CLEAN_PACKETS;
+	up->bufsz      = (64U * 2) * 2;
+	up->page       = 64U * 2;
+	up->flash_sz   = 0x1c00U * 2;
+	up->features   = INFO_LZ | INFO_FILL | INFO_HASH | INFO_CAL | INFO_STAT | INFO_SYNC;
+
+	return up;
+}
+
+/*
+	The session runs until wait_tty() or die() switches back here, or
+	until it is done. The first step sets its stack up.
+ */
+enum avr_upload_state avr_upload_step(struct avr_upload *up)
+{
+	uintptr_t ptr = (uintptr_t) up;
+
+	if (up->state != avr_upload_busy)
+		return up->state;
+	if (!up->stack) {
+		up->guard = (size_t) sysconf(_SC_PAGESIZE);
+		up->stack = mmap(NULL, STACK_SIZE + up->guard, PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (up->stack == MAP_FAILED)
+			up->stack = NULL;
+		if (!up->stack || mprotect(up->stack, up->guard, PROT_NONE) < 0 ||
+		    getcontext(&up->ctx) < 0) {
+			snprintf(up->msg, sizeof(up->msg), "ERROR (session): \"%s\"", strerror(errno));
+			up->state = avr_upload_failed;
+			goto out;
+		}
+		up->ctx.uc_stack.ss_sp   = (uint8_t *) up->stack + up->guard;
+		up->ctx.uc_stack.ss_size = STACK_SIZE;
+		up->ctx.uc_link          = &up->caller;
+		makecontext(&up->ctx, (void (*)(void)) run, 2,
+		            (unsigned int) (ptr >> 16 >> 16), (unsigned int) ptr);
+	}
+	swapcontext(&up->caller, &up->ctx);
+	if (up->state == avr_upload_busy)
+		return up->state;
+out:
+	release(up);
+	if (up->state == avr_upload_done && up->ops->done)
+		up->ops->done(up);
+	if (up->state == avr_upload_failed && up->ops->error)
+		up->ops->error(up, up->msg);
+
+	return up->state;
+}
+
+int avr_upload_fd(const struct avr_upload *up)
+{
+	return up->tty_fd;
+}
+
+short avr_upload_events(const struct avr_upload *up)
+{
+	return up->events;
+}
+
+long long avr_upload_deadline(const struct avr_upload *up)
+{
+	return up->deadline;
+}
+
+const struct avr_upload_stats *avr_upload_stats(const struct avr_upload *up)
+{
+	return &up->stats;
+}
+
+void *avr_upload_priv(const struct avr_upload *up)
+{
+	return up->priv;
+}
+
+void avr_upload_free(struct avr_upload *up)
+{
+	release(up);
+	free(up);
+}
@@ -0,0 +1,148 @@
+#ifndef __AVR_UPLOAD_H
+#define __AVR_UPLOAD_H 1
+
+#include <stdint.h>
+
+/*
+	Uploader as a library. A session flashes a single device and never
+	blocks: avr_upload_step() runs it until it has to wait for the tty.
+	The caller then waits for avr_upload_events() on avr_upload_fd(), or
+	until avr_upload_deadline(), whichever comes first, and steps it again.
+	Sessions share nothing, so any number of them run in one event loop.
+ */
+struct avr_upload;
+
+enum avr_upload_state {
+	avr_upload_busy,
+	avr_upload_done,
+	avr_upload_failed,
+};
+
+/* Kinds of progress lines */
+enum avr_upload_note {
+	/* A packet has passed */
+	avr_upload_packet,
+	/* A packet, query or calibration is repeated */
+	avr_upload_retry,
+	/* Anything else: the rate, what the device is built with and so on */
+	avr_upload_info,
+};
+
+/* What has become of a packet which leaves the window */
+enum avr_upload_result {
+	/* The device has stored it */
+	avr_upload_acked,
+	/* The device has reported it damaged */
+	avr_upload_nacked,
+	/* No answer came in time */
+	avr_upload_timeout,
+	/* It was behind a packet which failed, and is sent again */
+	avr_upload_dropped,
+};
+
+/* Packet of the upload, see avr_upload_ops.packet */
+struct avr_upload_packet {
+	/* File bytes the packet carries and its size on the line */
+	unsigned int off, size, len;
+	/* Type in its header: AVR_UPLOAD_DATA or AVR_UPLOAD_SEEK, maybe with flags */
+	unsigned int type;
+	/* The rate it went at */
+	unsigned int baud;
+	/* Failures its bytes have been through before it was sent */
+	unsigned int retries;
+	enum avr_upload_result result;
+	/*
+		Times of avr_upload_now_us(): the write of the packet starts and
+		ends, and its answer arrives or the wait for it is given up.
+	 */
+	long long write_us, sent_us, answer_us;
+};
+
+/* Types and flags of avr_upload_packet.type, those of `include/proto.h` */
+#define AVR_UPLOAD_DATA   0x00U
+#define AVR_UPLOAD_SEEK   0x01U
+#define AVR_UPLOAD_LZ     0x80U
+#define AVR_UPLOAD_FILL   0x40U
+
+/*
+	Callbacks of a session, called from within avr_upload_step(). progress
+	and packet run on the stack of the session, so keep them small. None
+	may call avr_upload_free() on the session it is called for: free it
+	once avr_upload_step() has returned.
+ */
+struct avr_upload_ops {
+	/* Line of progress, without the line end */
+	void (*progress)(struct avr_upload *up, enum avr_upload_note note, const char *msg);
+	/* The session has failed and @msg tells why. It takes no more steps */
+	void (*error)(struct avr_upload *up, const char *msg);
+	/* The file is flashed */
+	void (*done)(struct avr_upload *up);
+	/* A packet leaves the window, whatever became of it */
+	void (*packet)(struct avr_upload *up, const struct avr_upload_packet *pkt);
+};
+
+/* Formats of the file to flash */
+enum avr_upload_format {
+	/* ELF by its magic, Intel HEX by the name or its first record, else flat */
+	avr_upload_auto,
+	/* Flat image of flash from address 0 */
+	avr_upload_bin,
+	avr_upload_ihex,
+	avr_upload_elf,
+};
+
+struct avr_upload_opts {
+	/* Device to flash and the file, see upload_program() */
+	const char *tty, *path;
+	/* Send the whole file regardless of what the device holds */
+	int full;
+	/* Compress payloads */
+	int lz;
+	/* Calibrate the clock of the device before the upload */
+	int cal;
+	/* The device is known to run at this rate. Zero searches for it */
+	unsigned int baud;
+	/* Packets are no longer than this. Zero takes the buffer of the device */
+	unsigned int pktsz;
+	enum avr_upload_format format;
+};
+
+/* What the session has gone through so far */
+struct avr_upload_stats {
+	/* The rate the device has locked on last */
+	unsigned int baud;
+	unsigned int packets;
+	unsigned int retries;
+};
+
+/*
+	Creates a session. Strings of @opts and @ops are kept, not copied.
+	Nothing happens until the first step. Returns NULL on failure.
+ */
+struct avr_upload *avr_upload_new(const struct avr_upload_opts *opts,
+                                  const struct avr_upload_ops *ops, void *priv);
+/*
+	Runs the session until it waits for the tty or is over. Callbacks are
+	called from within. Once over, the session has closed its tty.
+ */
+enum avr_upload_state avr_upload_step(struct avr_upload *up);
+/* The tty, or -1 unless the session is running */
+int avr_upload_fd(const struct avr_upload *up);
+/* POLLIN or POLLOUT the session waits for, or 0 if only the deadline */
+short avr_upload_events(const struct avr_upload *up);
+/* Time of avr_upload_now_ms() the session is due by, or -1 if none */
+long long avr_upload_deadline(const struct avr_upload *up);
+const struct avr_upload_stats *avr_upload_stats(const struct avr_upload *up);
+void *avr_upload_priv(const struct avr_upload *up);
+void avr_upload_free(struct avr_upload *up);
+
+/* Milliseconds and microseconds of CLOCK_MONOTONIC */
+long long avr_upload_now_ms(void);
+long long avr_upload_now_us(void);
+/* Tells whether the sync is ever sent at @baud */
+int avr_upload_baud_ok(unsigned int baud);
+/* Tells whether packets may be capped at @pktsz bytes */
+int avr_upload_pktsz_ok(unsigned int pktsz);
+uint16_t usart_calc_csum(uint8_t *buf, uint16_t bufsz);
+
+#endif
@@ -1,56 +1,15 @@
 #include <stdarg.h>
-#include <stdint.h>
-#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <sys/mman.h>
-#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
-#include <termios.h>
-
-/* FIX ME */
-#define AVR_SPEED    B38400
-#define USART_BUFSZ  ((64 * 2) * 2)
-#define FLASH_SZ     (0x1c00U * 2)
-
-/* Header of the UART packet */
-struct hdr {
-	/* IPv4 checksum. Everything below this field is checksummed. */
-	uint16_t csum;
-	/* Length of the current packet */
-	uint16_t len;
-	/* Size of the file.
-	   File is splitted into several packets.
-	   Must be equal for all packets. */
-	uint16_t filesz;
-	/* Payload */
-} __attribute__((packed));
-
-uint16_t usart_calc_csum(uint8_t *buf, uint16_t bufsz)
-{
-	uint32_t sum;
-	uint16_t *ptr;
-
-	ptr = (uint16_t *) buf;
-	sum = 0U;
-
-	while (bufsz > 1U) {
-		sum   += *(ptr++);
-		bufsz -= 2U;
-	}
-
-	if (bufsz > 0U)
-		sum   += *((uint8_t *) ptr);
+#include <getopt.h>
+#include <glob.h>
+#include <sys/epoll.h>
 
-	while ((sum >> 16))
-		sum    = (sum & 0xffffU) + (sum >> 16);
-
-	return ~((uint16_t) sum);
-}
+#include "avr-upload.h"
 
 static inline void die(const char *msg, ...)
 {
@@ -63,112 +22,585 @@ static inline void die(const char *msg, ...)
 	exit(-1);
 }
 
-static void upload_program(int tty_fd, const char *path)
-{
-	uint8_t ack_data[2], msgbuf[USART_BUFSZ];
-	struct hdr *hdr = (struct hdr *) msgbuf;
-	uint8_t *pld = (uint8_t *) (&hdr[1]);
-	const unsigned int pldsz = sizeof(msgbuf) - sizeof(struct hdr);
-	struct {
-		const char *path;
-		int fd;
-		unsigned int size;
-		uint8_t *ptr;
-	} program;
-	struct stat st;
-	uint8_t *saved_ptr;
-	unsigned int saved_size;
-	program.path = path;
-	program.fd   = open(program.path, O_RDONLY);
-	if (program.fd < 0)
-		die("UPLOAD PROGRAM (open): \"%s\"\n", strerror(errno));
-	if (fstat(program.fd, &st) < 0)
-		die("UPLOAD PROGRAM (fstat): \"%s\"\n", strerror(errno));
-	program.size = st.st_size;
-	if (program.size > FLASH_SZ)
-		die("UPLOAD PROGRAM (invalid size): %u\n", program.size);
-	program.ptr  = mmap(NULL, program.size, PROT_READ, MAP_PRIVATE, program.fd, 0);
-	if (program.ptr == ((const uint8_t *) MAP_FAILED))
-		die("UPLOAD PROGRAM (mmap): \"%s\"\n", strerror(errno));
-	saved_ptr    = program.ptr;
-	saved_size   = program.size;
-	close(program.fd);
-	program.fd   = -1;
-
-	hdr->filesz = program.size;
-	while (program.size > 0) {
-		unsigned int msgsz;
-		int nread;
-
-		msgsz = (program.size > pldsz) ? pldsz : program.size;
-		memcpy(pld, program.ptr, msgsz);
-		hdr->len  = msgsz + sizeof(struct hdr);
-		hdr->csum = usart_calc_csum((uint8_t *) &hdr->len,
-		                            hdr->len - offsetof(struct hdr, len));
-		if (write(tty_fd, hdr, hdr->len) != hdr->len)
-			die("UPLOAD PROGRAM (write): \"%s\"\n", "failure");
-		nread     = read(tty_fd, ack_data, sizeof(ack_data));
-		if (nread <= 0)
-			die("UPLOAD PROGRAM (read): \"%s\"\n", "failure");
-		if (nread == 1) {
-			/* Success */
-			printf("COMPLETE transmission of %u - %u part\n",
-			       (unsigned int) (program.ptr - saved_ptr),
-			       (unsigned int) (program.ptr - saved_ptr) + msgsz);
-			program.ptr  += msgsz;
-			program.size -= msgsz;
-		} else {
-			/* Failure. Try to re-transmit current part */
-			printf("REPEAT transmission of %u - %u part\n",
-			       (unsigned int) (program.ptr - saved_ptr),
-			       (unsigned int) (program.ptr - saved_ptr) + msgsz);
-		}
+/* Milliseconds upto @deadline as poll() and epoll_wait() take them */
+static int time_left(long long deadline)
+{
+	long long left;
+
+	if (deadline < 0)
+		return -1;
+	left = deadline - avr_upload_now_ms();
+
+	return (left > 0) ? (int) left : 0;
+}
+
+/* Times of a kind of packet events, in microseconds */
+struct samples {
+	long long *us;
+	unsigned int nr, max;
+};
+
+/* What the packets of a device went through, see --stats */
+struct tele {
+	/* The session starts, its first packet is written, the last one is over */
+	long long start_us, first_us, last_us, end_us;
+	unsigned long long file_bytes, line_bytes, line_us, timeout_us;
+	unsigned int packets, resent, nacked, timeouts, dropped, baud;
+	/* Time to write a packet, and from its write until the answer */
+	struct samples write, answer;
+};
+
+/* A device to flash */
+struct device {
+	const char *tty, *path;
+	struct avr_upload *up;
+	/* The tty and the events registered with epoll */
+	int fd;
+	short events;
+	char last[256];
+	int over, failed;
+	/* Process of the device in the trace */
+	unsigned int pid;
+	struct tele tele;
+};
+
+/* Timeline of --trace in the JSON format of trace viewers */
+static FILE *trace;
+static long long trace_t0;
+static unsigned int trace_nr;
+
+static void trace_event(const char *fmt, ...)
+{
+	va_list ap;
+
+	if (!trace)
+		return;
+	fputs(trace_nr++ ? ",\n" : "{\"traceEvents\":[\n", trace);
+	va_start(ap, fmt);
+	vfprintf(trace, fmt, ap);
+	va_end(ap);
+}
+
+/* Puts @str as a JSON string */
+static void trace_string(const char *str)
+{
+	fputc('"', trace);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(trace, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(trace, "\\u%04x", *str);
+		else
+			fputc(*str, trace);
 	}
+	fputc('"', trace);
+}
 
-	munmap(saved_ptr, saved_size);
+static void trace_open(const char *path)
+{
+	trace = fopen(path, "w");
+	if (!trace)
+		die("TRACE (fopen): \"%s\"\n", strerror(errno));
+	trace_t0 = avr_upload_now_us();
 }
 
-int main(int argc, char **argv)
+static void trace_close(void)
+{
+	if (!trace)
+		return;
+	fputs(trace_nr ? "\n]}\n" : "{\"traceEvents\":[]}\n", trace);
+	if (fclose(trace))
+		die("TRACE (fclose): \"%s\"\n", strerror(errno));
+	trace = NULL;
+}
+
+/* Names the device in the trace */
+static void trace_device(const struct device *dev)
+{
+	trace_event("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":",
+	            dev->pid);
+	if (trace)
+		trace_string(dev->tty);
+	if (trace)
+		fputs("}}", trace);
+}
+
+/* Progress of the device is an instant event of the trace */
+static void trace_note(const struct device *dev, const char *msg)
+{
+	trace_event("{\"ph\":\"i\",\"s\":\"p\",\"pid\":%u,\"tid\":1,\"ts\":%lld,\"name\":",
+	            dev->pid, avr_upload_now_us() - trace_t0);
+	if (trace)
+		trace_string(msg);
+	if (trace)
+		fputc('}', trace);
+}
+
+static void samples_add(struct samples *smp, long long us)
+{
+	if (smp->nr == smp->max) {
+		smp->max = smp->max ? smp->max * 2 : 256;
+		smp->us  = realloc(smp->us, smp->max * sizeof(*smp->us));
+		if (!smp->us)
+			die("STATS (realloc): \"%s\"\n", strerror(errno));
+	}
+	smp->us[smp->nr++] = us;
+}
+
+static const char *const results[] = {
+	[avr_upload_acked]   = "acked",
+	[avr_upload_nacked]  = "nacked",
+	[avr_upload_timeout] = "timeout",
+	[avr_upload_dropped] = "dropped",
+};
+
+/*
+	Counts the packet for --stats. In the trace its write goes to the host
+	thread, and its way from the write to the answer is an async slice.
+ */
+static void packet(struct avr_upload *up, const struct avr_upload_packet *pkt)
+{
+	struct device *dev = avr_upload_priv(up);
+	struct tele *tele = &dev->tele;
+	unsigned int id;
+	char name[64];
+
+	if (!tele->first_us)
+		tele->first_us = pkt->write_us;
+	tele->last_us     = pkt->answer_us;
+	tele->line_bytes += pkt->len;
+	tele->line_us    += (unsigned long long) pkt->len * 10U * 1000000U / pkt->baud;
+	if (tele->baud < pkt->baud)
+		tele->baud = pkt->baud;
+	tele->packets++;
+	tele->resent     += !!pkt->retries;
+	samples_add(&tele->write, pkt->sent_us - pkt->write_us);
+	switch (pkt->result) {
+	case avr_upload_acked:
+		tele->file_bytes += pkt->size;
+		samples_add(&tele->answer, pkt->answer_us - pkt->sent_us);
+		break;
+	case avr_upload_nacked:
+		tele->nacked++;
+		break;
+	case avr_upload_timeout:
+		tele->timeouts++;
+		tele->timeout_us += pkt->answer_us - pkt->sent_us;
+		break;
+	case avr_upload_dropped:
+		tele->dropped++;
+		break;
+	}
+
+	if (!trace)
+		return;
+	snprintf(name, sizeof(name), "%s%s%s %u - %u",
+	         ((pkt->type & ~(AVR_UPLOAD_LZ | AVR_UPLOAD_FILL)) == AVR_UPLOAD_SEEK) ? "SEEK" : "DATA",
+	         (pkt->type & AVR_UPLOAD_LZ) ? "+LZ" : "", (pkt->type & AVR_UPLOAD_FILL) ? "+FILL" : "",
+	         pkt->off, pkt->off + pkt->size);
+	id = trace_nr;
+	trace_event("{\"name\":\"write\",\"ph\":\"X\",\"pid\":%u,\"tid\":1,"
+	            "\"ts\":%lld,\"dur\":%lld,\"args\":{\"len\":%u}}",
+	            dev->pid, pkt->write_us - trace_t0, pkt->sent_us - pkt->write_us, pkt->len);
+	trace_event("{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"b\",\"id\":%u,"
+	            "\"pid\":%u,\"tid\":2,\"ts\":%lld}",
+	            name, id, dev->pid, pkt->sent_us - trace_t0);
+	trace_event("{\"name\":\"%s\",\"cat\":\"packet\",\"ph\":\"e\",\"id\":%u,"
+	            "\"pid\":%u,\"tid\":2,\"ts\":%lld,\"args\":{\"result\":\"%s\","
+	            "\"len\":%u,\"size\":%u,\"baud\":%u,\"retries\":%u}}",
+	            name, id, dev->pid, pkt->answer_us - trace_t0,
+	            results[pkt->result], pkt->len, pkt->size, pkt->baud, pkt->retries);
+}
+
+static int cmp_us(const void *a, const void *b)
+{
+	const long long *x = a, *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/* Percentiles of @smp, which gets sorted */
+static void print_percentiles(const char *tag, const char *what, struct samples *smp)
+{
+	if (!smp->nr)
+		return;
+	qsort(smp->us, smp->nr, sizeof(*smp->us), cmp_us);
+	printf("%sSTATS %s us: p50 %lld, p90 %lld, p99 %lld, max %lld\n", tag, what,
+	       smp->us[(smp->nr - 1) * 50 / 100], smp->us[(smp->nr - 1) * 90 / 100],
+	       smp->us[(smp->nr - 1) * 99 / 100], smp->us[smp->nr - 1]);
+}
+
+/* Histogram of sorted @smp in buckets of powers of two */
+static void print_histogram(const char *tag, const char *what, const struct samples *smp)
 {
-	int tty_fd, flags;
-	struct termios tios;
+	unsigned int count[64] = { 0 }, lo, hi, b, peak, i;
+	long long us;
 
-	if (argc < 3)
-		die("USAGE: %s <tty device> <file name to flash>\n", argv[0]);
+	if (!smp->nr)
+		return;
+	for (i = 0; i < smp->nr; i++) {
+		for (b = 0, us = smp->us[i]; us > 1; us >>= 1)
+			b++;
+		count[b]++;
+	}
+	for (lo = 0; !count[lo]; lo++)
+		;
+	for (hi = 63; !count[hi]; hi--)
+		;
+	for (b = lo, peak = 0; b <= hi; b++)
+		peak = (count[b] > peak) ? count[b] : peak;
+	printf("%sSTATS %s histogram:\n", tag, what);
+	for (b = lo; b <= hi; b++)
+		printf("%sSTATS %9llu - %9llu us %-40.*s %u\n", tag, 1ULL << b, (2ULL << b) - 1,
+		       (int) ((count[b] * 40U + peak - 1) / peak),
+		       "########################################", count[b]);
+}
+
+/*
+	Prints what the packets of @dev went through. Goodput is measured
+	against the raw rate of the fastest line the device has locked on.
+	The line is busy for the time its packets take at their rates, and
+	the time outside of packets goes to the sync, the hashes and so on.
+ */
+static void print_stats(struct device *dev, const char *tag)
+{
+	struct tele *tele = &dev->tele;
+	long long total = tele->end_us - tele->start_us;
+	long long xfer  = tele->last_us - tele->first_us;
+
+	if (!total || !tele->packets) {
+		printf("%sSTATS no packets\n", tag);
+		return;
+	}
+	printf("%sSTATS %llu file bytes in %lld.%03lld s: %llu B/s, line %u B/s at %u bps, %llu%%\n",
+	       tag, tele->file_bytes, total / 1000000, total % 1000000 / 1000,
+	       tele->file_bytes * 1000000U / total, tele->baud / 10U, tele->baud,
+	       tele->file_bytes * 1000000U / total * 100U / (tele->baud / 10U));
+	printf("%sSTATS %u packets of %llu bytes, %u resent, %u NACKed, %u timed out, %u dropped\n",
+	       tag, tele->packets, tele->line_bytes, tele->resent, tele->nacked,
+	       tele->timeouts, tele->dropped);
+	printf("%sSTATS %lld.%03lld s before packets, %lld.%03lld s of packets with the line "
+	       "busy %llu%%, %lld.%03lld s waiting for timeouts\n", tag,
+	       (tele->first_us - tele->start_us) / 1000000,
+	       (tele->first_us - tele->start_us) % 1000000 / 1000,
+	       xfer / 1000000, xfer % 1000000 / 1000,
+	       xfer ? tele->line_us * 100U / xfer : 0ULL,
+	       (long long) tele->timeout_us / 1000000, (long long) tele->timeout_us % 1000000 / 1000);
+	print_percentiles(tag, "write", &tele->write);
+	print_percentiles(tag, "answer", &tele->answer);
+	print_histogram(tag, "answer", &tele->answer);
+}
+
+static void progress(struct avr_upload *up, enum avr_upload_note note, const char *msg)
+{
+	/* Packets are slices of the trace on their own */
+	if (note != avr_upload_packet)
+		trace_note(avr_upload_priv(up), msg);
+	printf("%s\n", msg);
+}
+
+static void error(struct avr_upload *up, const char *msg)
+{
+	trace_note(avr_upload_priv(up), msg);
+	fprintf(stderr, "%s\n", msg);
+}
 
-	errno  = 0;
+/*
+	Flashes the device the way the library is meant to be driven:
+	waits for what the session waits for and steps it.
+ */
+static int flash_device(const struct avr_upload_opts *opts, int stats)
+{
+	static const struct avr_upload_ops ops = {
+		.progress = progress,
+		.error    = error,
+		.packet   = packet,
+	};
+	enum avr_upload_state state;
+	struct device dev;
+	struct pollfd pfd;
 
-	tty_fd = open(argv[1], O_RDWR | O_NOCTTY | O_SYNC | O_NONBLOCK);
-	if (tty_fd < 0)
-		die("ERROR (open): \"%s\"\n", strerror(errno));
+	memset(&dev, 0, sizeof(dev));
+	dev.tty = opts->tty;
+	dev.pid = 1;
+	dev.up  = avr_upload_new(opts, &ops, &dev);
+	if (!dev.up)
+		die("ERROR (session): \"%s\"\n", strerror(errno));
+	trace_device(&dev);
+	dev.tele.start_us = avr_upload_now_us();
+	while ((state = avr_upload_step(dev.up)) == avr_upload_busy) {
+		pfd.fd      = avr_upload_fd(dev.up);
+		pfd.events  = avr_upload_events(dev.up);
+		pfd.revents = 0;
+		if (poll(&pfd, 1, time_left(avr_upload_deadline(dev.up))) < 0 && errno != EINTR)
+			die("ERROR (poll): \"%s\"\n", strerror(errno));
+	}
+	dev.tele.end_us = avr_upload_now_us();
+	avr_upload_free(dev.up);
+	if (stats)
+		print_stats(&dev, "");
 
-	flags  = fcntl(tty_fd, F_GETFL);
-	if (flags < 0)
-		die("ERROR (fcntl#1): \"%s\"\n", strerror(errno));
-	flags &= ~(O_NONBLOCK);
-	if (fcntl(tty_fd, F_SETFL, flags) < 0)
-		die("ERROR (fcntl#2): \"%s\"\n", strerror(errno));
+	return (state == avr_upload_done) ? 0 : -1;
+}
 
-	if (tcgetattr(tty_fd, &tios) < 0)
-		die("ERROR (tcgetattr): \"%s\"\n", strerror(errno));
+/* Packets which pass are only counted, the rest goes out tagged with the device */
+static void device_progress(struct avr_upload *up, enum avr_upload_note note, const char *msg)
+{
+	struct device *dev = avr_upload_priv(up);
 
-	cfsetispeed(&tios, AVR_SPEED);
-	cfsetospeed(&tios, AVR_SPEED);
+	if (note == avr_upload_packet)
+		return;
+	trace_note(dev, msg);
+	snprintf(dev->last, sizeof(dev->last), "%s", msg);
+	printf("%s: %s\n", dev->tty, msg);
+}
 
-	tios.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF);
-	tios.c_oflag &= ~(OPOST);
-	tios.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
-	tios.c_cflag &= ~(CSIZE | PARENB);
-	tios.c_cflag |= CS8;
-	/* 2 bytes - maximum message length */
-	tios.c_cc[VMIN]  = 2;
-	/* 1 seconds interbyte timeout */
-	tios.c_cc[VTIME] = 10;
+static void device_error(struct avr_upload *up, const char *msg)
+{
+	struct device *dev = avr_upload_priv(up);
 
-	if (tcsetattr(tty_fd, TCSANOW, &tios) < 0)
-		die("ERROR (tcsetattr): \"%s\"\n", strerror(errno));
+	dev->failed = 1;
+	device_progress(up, avr_upload_info, msg);
+}
 
-	upload_program(tty_fd, argv[2]);
+/*
+	Steps the session of @dev and follows its tty with @ep.
+	Returns non-zero once the session is over. It closes the tty,
+	and the tty leaves the epoll set with that.
+ */
+static int device_step(int ep, struct device *dev)
+{
+	struct epoll_event ev;
+	int fd;
+
+	/* Both the tty and the deadline may have called for it */
+	if (dev->over)
+		return 0;
+	if (avr_upload_step(dev->up) != avr_upload_busy) {
+		dev->tele.end_us = avr_upload_now_us();
+		dev->fd   = -1;
+		dev->over = 1;
+		return 1;
+	}
+	fd          = avr_upload_fd(dev->up);
+	ev.events   = ((avr_upload_events(dev->up) & POLLIN) ? EPOLLIN : 0) |
+	              ((avr_upload_events(dev->up) & POLLOUT) ? EPOLLOUT : 0);
+	ev.data.ptr = dev;
+	if (fd == dev->fd && ev.events == (unsigned int) dev->events)
+		return 0;
+	if (epoll_ctl(ep, (fd == dev->fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) < 0)
+		die("MULTI (epoll_ctl): \"%s\"\n", strerror(errno));
+	dev->fd     = fd;
+	dev->events = ev.events;
 
-	exit(0);
+	return 0;
+}
+
+/*
+	Flashes many devices at once. Every argument of @args is a tty device
+	or a glob of them, optionally followed by `=` and a file which replaces
+	the one of @opts for them. Every device gets a session of its own and
+	a single epoll loop drives them all. The summary table follows once all
+	are done. Returns the number of devices which failed.
+ */
+static unsigned int flash_many(const struct avr_upload_opts *opts, char **args, int nr_args,
+                               int with_stats)
+{
+	static const struct avr_upload_ops ops = {
+		.progress = device_progress,
+		.error    = device_error,
+		.packet   = packet,
+	};
+	struct avr_upload_opts dev_opts;
+	struct epoll_event evs[64];
+	struct device *devs = NULL, *dev;
+	unsigned int nr = 0, running, failed, i;
+	const struct avr_upload_stats *stats;
+	long long deadline, now;
+	int ep, n, a;
+	glob_t gl;
+	char *arg, *file, tag[256];
+
+	for (a = 0; a < nr_args; a++) {
+		arg  = strdup(args[a]);
+		if (!arg)
+			die("MULTI (strdup): \"%s\"\n", strerror(errno));
+		file = strchr(arg, '=');
+		if (file)
+			*(file++) = '\0';
+		/* Devices which don't exist fail on their own */
+		if (glob(arg, GLOB_NOCHECK, NULL, &gl))
+			die("MULTI (glob): \"%s\"\n", arg);
+		devs = realloc(devs, (nr + gl.gl_pathc) * sizeof(*devs));
+		if (!devs)
+			die("MULTI (realloc): \"%s\"\n", strerror(errno));
+		for (i = 0; i < gl.gl_pathc; i++, nr++) {
+			memset(&devs[nr], 0, sizeof(devs[nr]));
+			devs[nr].tty  = strdup(gl.gl_pathv[i]);
+			devs[nr].path = file ? file : opts->path;
+			devs[nr].fd   = -1;
+			if (!devs[nr].tty)
+				die("MULTI (strdup): \"%s\"\n", strerror(errno));
+		}
+		globfree(&gl);
+	}
+	if (!nr)
+		die("MULTI (devices): \"%s\"\n", "none");
+
+	ep = epoll_create1(0);
+	if (ep < 0)
+		die("MULTI (epoll_create1): \"%s\"\n", strerror(errno));
+	running = nr;
+	for (i = 0; i < nr; i++) {
+		dev           = &devs[i];
+		dev_opts      = *opts;
+		dev_opts.tty  = dev->tty;
+		dev_opts.path = dev->path;
+		dev->up       = avr_upload_new(&dev_opts, &ops, dev);
+		if (!dev->up)
+			die("MULTI (session): \"%s\"\n", strerror(errno));
+		dev->pid      = i + 1;
+		trace_device(dev);
+		dev->tele.start_us = avr_upload_now_us();
+		running      -= device_step(ep, dev);
+	}
+
+	while (running) {
+		/* Sessions are due by the nearest deadline at the latest */
+		deadline = -1;
+		for (i = 0; i < nr; i++) {
+			now = avr_upload_deadline(devs[i].up);
+			if (now >= 0 && (deadline < 0 || now < deadline))
+				deadline = now;
+		}
+		n = epoll_wait(ep, evs, sizeof(evs) / sizeof(evs[0]), time_left(deadline));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			die("MULTI (epoll_wait): \"%s\"\n", strerror(errno));
+		}
+		for (a = 0; a < n; a++)
+			running -= device_step(ep, evs[a].data.ptr);
+		now = avr_upload_now_ms();
+		for (i = 0; i < nr; i++) {
+			deadline = avr_upload_deadline(devs[i].up);
+			if (deadline >= 0 && deadline <= now)
+				running -= device_step(ep, &devs[i]);
+		}
+	}
+	close(ep);
+
+	printf("%-24s %-6s %8s %8s %8s %8s  %s\n",
+	       "DEVICE", "RESULT", "BPS", "PACKETS", "RETRIES", "SECONDS", "FILE / ERROR");
+	for (i = 0, failed = 0; i < nr; i++) {
+		dev    = &devs[i];
+		stats  = avr_upload_stats(dev->up);
+		failed += dev->failed;
+		printf("%-24s %-6s %8u %8u %8u %5lld.%02lld  %s\n",
+		       dev->tty, dev->failed ? "FAILED" : "OK", stats->baud, stats->packets,
+		       stats->retries, (dev->tele.end_us - dev->tele.start_us) / 1000000,
+		       (dev->tele.end_us - dev->tele.start_us) % 1000000 / 10000,
+		       dev->failed ? dev->last : dev->path);
+	}
+	for (i = 0; i < nr; i++) {
+		dev = &devs[i];
+		snprintf(tag, sizeof(tag), "%s: ", dev->tty);
+		if (with_stats)
+			print_stats(dev, tag);
+		avr_upload_free(dev->up);
+	}
+
+	return failed;
+}
+
+#define USAGE    "USAGE: %s [-F] [-z] [-C] [-b baud] [-P bytes] [-t bin|ihex|elf] [--stats] " \
+		"[--trace <json file>] <tty device> <file name to flash>\n" \
+		"       %s -m [-F] [-z] [-C] [-b baud] [-P bytes] [-t bin|ihex|elf] [--stats] " \
+		"[--trace <json file>] <file name to flash> <tty device or glob>[=<file name>]...\n"
+
+/* Names of the formats -t takes */
+static const char *const formats[] = {
+	[avr_upload_bin]  = "bin",
+	[avr_upload_ihex] = "ihex",
+	[avr_upload_elf]  = "elf",
+};
+
+int main(int argc, char **argv)
+{
+	static const struct option longopts[] = {
+		{ "stats", no_argument,       NULL, 's' },
+		{ "trace", required_argument, NULL, 'T' },
+		{ NULL,    0,                 NULL, 0   },
+	};
+	struct avr_upload_opts opts;
+	unsigned int i;
+	int opt, multi, stats, ret;
+
+	memset(&opts, 0, sizeof(opts));
+	multi = 0;
+	stats = 0;
+	while ((opt = getopt_long(argc, argv, "FzCmb:P:t:sT:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'C':
+			/* Calibrate the clock of the device before the upload */
+			opts.cal  = 1;
+			break;
+		case 'b':
+			/* Skip the search, the device is known to run at this rate */
+			opts.baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			/* Packets no longer than this, the device may take more */
+			opts.pktsz = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			/* Format of the file, otherwise it is guessed */
+			for (i = avr_upload_bin; i < sizeof(formats) / sizeof(formats[0]); i++)
+				if (!strcmp(optarg, formats[i]))
+					break;
+			if (i == sizeof(formats) / sizeof(formats[0]))
+				die("ERROR (format): \"%s\" is not supported\n", optarg);
+			opts.format = i;
+			break;
+		case 'F':
+			/* Send the whole file regardless of what the device holds */
+			opts.full = 1;
+			break;
+		case 'm':
+			/* Flash many devices at once, see flash_many() */
+			multi     = 1;
+			break;
+		case 's':
+			/* Print what the packets went through, see print_stats() */
+			stats     = 1;
+			break;
+		case 'T':
+			/* Write the timeline of packets for a trace viewer */
+			trace_open(optarg);
+			break;
+		case 'z':
+			/* Compress payloads */
+			opts.lz   = 1;
+			break;
+		default:
+			die(USAGE, argv[0], argv[0]);
+		}
+	}
+	if (argc - optind < 2)
+		die(USAGE, argv[0], argv[0]);
+	if (opts.baud && !avr_upload_baud_ok(opts.baud))
+		die("ERROR (rate): %u bps is not supported\n", opts.baud);
+	if (opts.pktsz && !avr_upload_pktsz_ok(opts.pktsz))
+		die("ERROR (packet): %u bytes is not supported\n", opts.pktsz);
+
+	if (multi) {
+		opts.path = argv[optind];
+		ret = flash_many(&opts, &argv[optind + 1], argc - optind - 1, stats) ? -1 : 0;
+	} else {
+		opts.tty  = argv[optind];
+		opts.path = argv[optind + 1];
+		ret = flash_device(&opts, stats);
+	}
+	trace_close();
+	exit(ret);
 }
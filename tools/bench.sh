@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+#	Throughput of flashing. Every combination of image size, packet size,
+#	rate and error rate is flashed by avr-uploader into a fresh avr-sim,
+#	and a line of tab separated fields goes to the standard output:
+#
+#		rev size packet baud err_ppm result seconds bytes_s line_bytes_s efficiency
+#
+#	`rev` is the commit of the source tree, so tables of several commits
+#	concatenate and compare. Images are the same pseudo-random bytes on
+#	every machine. A run is OK only if the flash of the sim holds the image
+#	afterwards. `make bench` runs it with the BENCH_* variables of the
+#	Makefile, see there.
+#
+#	USAGE: bench.sh <avr-sim> <avr-uploader> <source tree>
+#
+
+set -u
+
+sim=$1
+upldr=$2
+src_root=$3
+
+: "${BENCH_SIZES:=2048 14336}"
+: "${BENCH_PACKETS:=64 128 256}"
+: "${BENCH_BAUDS:=1000000 38400}"
+: "${BENCH_ERRORS:=0 1000}"
+: "${BENCH_FLAGS:=}"
+
+rev=$(git -C "$src_root" rev-parse --short HEAD 2>/dev/null || echo -)
+tmp=$(mktemp -d)
+sim_pid=
+
+stop_sim() {
+	if test -n "$sim_pid"; then
+		kill "$sim_pid" 2>/dev/null
+		wait "$sim_pid" 2>/dev/null
+		sim_pid=
+	fi
+}
+
+trap 'stop_sim; rm -rf "$tmp"' EXIT
+trap 'exit 1' INT TERM
+
+# $1 bytes of a 32 bit LCG, exact in the doubles of any awk
+image() {
+	LC_ALL=C awk -v n="$1" 'BEGIN {
+		x = 1
+		for (i = 0; i < n; i++) {
+			x = (x * 69069 + 1) % 4294967296
+			printf "%c", int(x / 16777216)
+		}
+	}'
+}
+
+now_ns() {
+	date +%s%N
+}
+
+printf 'rev\tsize\tpacket\tbaud\terr_ppm\tresult\tseconds\tbytes_s\tline_bytes_s\tefficiency\n'
+
+for size in $BENCH_SIZES; do
+	image "$size" > "$tmp/image.bin"
+	for pkt in $BENCH_PACKETS; do
+		for baud in $BENCH_BAUDS; do
+			for err in $BENCH_ERRORS; do
+				rm -f "$tmp/pty" "$tmp/flash.bin"
+				"$sim" -p "$tmp/pty" -o "$tmp/flash.bin" -e "$err" -E "$err" > /dev/null 2>&1 &
+				sim_pid=$!
+				while ! test -e "$tmp/pty"; do
+					kill -0 "$sim_pid" 2>/dev/null || exit 1
+					sleep 0.05
+				done
+
+				start=$(now_ns)
+				"$upldr" -b "$baud" -P "$pkt" $BENCH_FLAGS "$tmp/pty" "$tmp/image.bin" \
+				         > "$tmp/log" 2>&1
+				upld_rc=$?
+				end=$(now_ns)
+
+				# The sim dumps its flash once the last page is written
+				kill "$sim_pid" 2>/dev/null
+				wait "$sim_pid"
+				sim_rc=$?
+				sim_pid=
+				if test "$upld_rc" -eq 0 && test "$sim_rc" -eq 0 &&
+				   cmp -s -n "$size" "$tmp/image.bin" "$tmp/flash.bin"; then
+					result=OK
+				else
+					result=FAILED
+				fi
+
+				awk -v rev="$rev" -v size="$size" -v pkt="$pkt" -v baud="$baud" \
+				    -v err="$err" -v result="$result" -v ns=$((end - start)) 'BEGIN {
+					s    = ns / 1e9
+					bps  = (result == "OK") ? size / s : 0
+					line = baud / 10
+					printf "%s\t%u\t%u\t%u\t%u\t%s\t%.3f\t%.0f\t%.0f\t%.3f\n",
+					       rev, size, pkt, baud, err, result, s, bps, line, bps / line
+				}'
+			done
+		done
+	done
+done